@@ -13,30 +13,525 @@
 #pragma once
 #include "types.h"
 #include <zlib.h>
+#include <atomic>
+#include <climits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+
+#ifdef DOCPDF_USE_ZLIB_NG
+#include <zlib-ng.h>
+#endif
+#ifdef DOCPDF_USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 
 #pragma comment(lib, "zdll.lib")
 
+// the libraries that can compress the streams; zlib-ng and libdeflate are compiled in by defining
+// DOCPDF_USE_ZLIB_NG and DOCPDF_USE_LIBDEFLATE, and the application links them.
+// See stream_compressor::use_backend()
+enum class deflate_backend { zlib, zlib_ng, libdeflate };
+
+// how each kind of stream is compressed; see docpdf::use_compression_profile().
+// A level of 0 writes that kind of stream uncompressed
+struct compression_profile
+{
+    int m_content_level{ 9 }; // the page contents, the object streams and the xref stream
+    int m_image_level{ 9 };
+    int m_font_level{ 9 }; // the embedded font files
+    size_t m_min_size{ 0 }; // shorter streams are written uncompressed
+    // for a longer stream, only this much of its beginning is compressed first, and the stream is
+    // written uncompressed if that doesn't shrink by a tenth, e.g., already compressed image data.
+    // 0 compresses every stream
+    size_t m_sample_size{ 0 };
+
+    // for interactive use: about the speed of no compression, still much smaller
+    static compression_profile fastest()
+    {
+        return compression_profile{ 1, 1, 1, 64, 16 * 1024 };
+    }
+    static compression_profile balanced()
+    {
+        return compression_profile{ 6, 6, 6, 64, 16 * 1024 };
+    }
+    // for archiving: the smallest files
+    static compression_profile smallest()
+    {
+        return compression_profile{ 9, 9, 9, 0, 0 };
+    }
+    bool valid() const
+    {
+        return m_content_level >= 0 && m_content_level <= 9 && m_image_level >= 0 && m_image_level <= 9
+            && m_font_level >= 0 && m_font_level <= 9;
+    }
+};
+
+// the threads that compress the chunks of the large streams; shared by all the documents.
+// The thread that submits a batch works on it too, so a batch finishes even if the pool is busy
+class deflate_pool
+{
+    struct batch
+    {
+        std::function<void(size_t)> m_job;
+        size_t m_count{ 0 };
+        std::atomic<size_t> m_next{ 0 };
+        std::atomic<size_t> m_done{ 0 };
+        std::mutex m_mutex;
+        std::condition_variable m_finished;
+
+        void work()
+        {
+            size_t i;
+
+            while ((i = m_next++) < m_count)
+            {
+                m_job(i);
+
+                if (++m_done == m_count)
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+
+                    m_finished.notify_all();
+                }
+            }
+        }
+    };
+
+    std::mutex m_mutex;
+    std::condition_variable m_ready;
+    std::deque<std::shared_ptr<batch>> m_queue;
+    std::vector<std::thread> m_threads;
+    bool m_stop{ false };
+private:
+    deflate_pool() : m_mutex(), m_ready(), m_queue(), m_threads()
+    {
+        unsigned count = std::thread::hardware_concurrency();
+
+        try
+        {
+            for (unsigned i = 1; i < count; ++i)
+            {
+                m_threads.emplace_back([this] { worker(); });
+            }
+        }
+        catch (...)
+        {
+            // fewer threads
+        }
+    }
+    ~deflate_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            m_stop = true;
+        }
+
+        m_ready.notify_all();
+
+        for (auto& t : m_threads)
+        {
+            t.join();
+        }
+    }
+    void worker()
+    {
+        for (;;)
+        {
+            std::shared_ptr<batch> next;
+
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+
+                m_ready.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+
+                if (m_queue.empty())
+                {
+                    return;
+                }
+
+                next = std::move(m_queue.front());
+
+                m_queue.pop_front();
+            }
+
+            next->work();
+        }
+    }
+public:
+    deflate_pool(const deflate_pool&) = delete;
+    deflate_pool& operator=(const deflate_pool&) = delete;
+
+    static deflate_pool& instance()
+    {
+        static deflate_pool pool;
+
+        return pool;
+    }
+    // the number of threads besides the caller's
+    size_t size() const
+    {
+        return m_threads.size();
+    }
+    // calls job(0) to job(count - 1) on the threads of the pool and on the calling thread, and
+    // returns when they are done. The job must not throw
+    void run(size_t count, std::function<void(size_t)> job)
+    {
+        std::shared_ptr<batch> work;
+
+        try
+        {
+            work = std::make_shared<batch>();
+
+            work->m_job = std::move(job);
+            work->m_count = count;
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            for (size_t i = 1; i < count && i <= m_threads.size(); ++i)
+            {
+                m_queue.push_back(work);
+            }
+        }
+        catch (...)
+        {
+            throw std::runtime_error("Out of memory");
+        }
+
+        m_ready.notify_all();
+
+        work->work();
+
+        std::unique_lock<std::mutex> lock(work->m_mutex);
+
+        work->m_finished.wait(lock, [&work] { return work->m_done == work->m_count; });
+    }
+};
+
+// a deflate library that works through a z_stream, i.e., zlib or zlib-ng. Each thread keeps one
+// stream per compression level, and resets it between two PDF streams instead of initializing
+// it anew; the initialization costs more than compressing a small page
+template<typename library>
+class zstream_codec
+{
+    struct context
+    {
+        typename library::stream_type m_stream;
+        bool m_initialized{ false };
+
+        context()
+        {
+            memset(&m_stream, 0, sizeof(m_stream));
+        }
+        ~context()
+        {
+            if (m_initialized)
+            {
+                library::end(&m_stream);
+            }
+        }
+    };
+
+    static constexpr size_t chunk_size = 128 * 1024;
+    static constexpr size_t dictionary_size = 32 * 1024; // the deflate window
+
+    // ready to compress at 'level' in the zlib format, or as raw deflate data;
+    // null if the stream can't be initialized
+    static typename library::stream_type* stream(int level, bool raw = false)
+    {
+        thread_local context contexts[2][10];
+        context& ctx = contexts[raw][level];
+
+        if (!ctx.m_initialized)
+        {
+            ctx.m_initialized = ((raw ? library::init_raw(&ctx.m_stream, level) : library::init(&ctx.m_stream, level)) == Z_OK);
+
+            return ctx.m_initialized ? &ctx.m_stream : nullptr;
+        }
+        return (library::reset(&ctx.m_stream) == Z_OK) ? &ctx.m_stream : nullptr;
+    }
+public:
+    // compresses into 'dest_data', which holds 'dest_length' bytes; returns the size of the
+    // compressed data, or 0 if it doesn't fit
+    static size_t compress(byte_t* dest_data, size_t dest_length, const byte_t* source_data, size_t source_length, int level)
+    {
+        typename library::stream_type* strm = stream(level);
+        size_t in_left = source_length, out_left = dest_length;
+        int ret;
+
+        if (!strm)
+        {
+            return 0;
+        }
+
+        strm->next_in = (byte_t*)source_data; // not const in zlib
+        strm->next_out = dest_data;
+
+        // avail_in and avail_out are 32 bits
+        do
+        {
+            unsigned in_chunk = (unsigned)(std::min)(in_left, (size_t)UINT_MAX);
+            unsigned out_chunk = (unsigned)(std::min)(out_left, (size_t)UINT_MAX);
+
+            strm->avail_in = in_chunk;
+            strm->avail_out = out_chunk;
+
+            ret = library::deflate(strm, (in_chunk == in_left) ? Z_FINISH : Z_NO_FLUSH);
+
+            in_left -= in_chunk - strm->avail_in;
+            out_left -= out_chunk - strm->avail_out;
+
+        } while (Z_OK == ret && out_left > 0);
+
+        return (Z_STREAM_END == ret) ? dest_length - out_left : 0;
+    }
+    // compresses a chunk of a large stream as raw deflate data primed with the bytes before it;
+    // the data of a chunk other than the last ends on a byte boundary, so the next can follow it
+    static size_t compress_chunk(byte_t* dest_data, size_t dest_length, const byte_t* source_data, size_t source_length,
+        size_t dictionary_length, int level, bool last)
+    {
+        typename library::stream_type* strm = stream(level, true);
+        int ret;
+
+        if (!strm)
+        {
+            return 0;
+        }
+        else if (dictionary_length != 0 && library::set_dictionary(strm, source_data - dictionary_length, (unsigned)dictionary_length) != Z_OK)
+        {
+            return 0;
+        }
+
+        strm->next_in = (byte_t*)source_data; // not const in zlib
+        strm->avail_in = (unsigned)source_length;
+        strm->next_out = dest_data;
+        strm->avail_out = (unsigned)dest_length;
+
+        ret = library::deflate(strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+
+        if (last ? (ret != Z_STREAM_END) : (ret != Z_OK || 0 == strm->avail_out))
+        {
+            return 0;
+        }
+        return dest_length - strm->avail_out;
+    }
+    // compresses a large stream the way pigz does: its 128 KB chunks are compressed on the threads
+    // of deflate_pool, then joined between a zlib header and the Adler-32 of the whole stream.
+    // Priming each chunk with the 32 KB before it keeps the output about as small as in one piece
+    static size_t compress_parallel(byte_t* dest_data, size_t dest_length, const byte_t* source_data, size_t source_length, int level)
+    {
+        size_t count = (source_length + chunk_size - 1) / chunk_size, length = 2;
+        std::vector<byte_vector> chunks;
+        std::vector<uLong> checksums;
+        std::atomic<bool> failed{ false };
+        uLong adler;
+        // the compression level is noted in the header: 0 for the fastest to 3 for the smallest
+        byte_t flags = (byte_t)(((level < 2) ? 0 : (level < 6) ? 1 : (6 == level) ? 2 : 3) << 6);
+
+        try
+        {
+            chunks.resize(count);
+            checksums.resize(count);
+        }
+        catch (...)
+        {
+            return 0;
+        }
+
+        deflate_pool::instance().run(count, [&](size_t i)
+        {
+            size_t offset = i * chunk_size;
+            size_t size = (std::min)(chunk_size, source_length - offset);
+
+            try
+            {
+                chunks[i].resize(compressBound((uLong)size) + 16);
+            }
+            catch (...)
+            {
+                failed = true;
+
+                return;
+            }
+
+            size = compress_chunk(chunks[i].data(), chunks[i].size(), source_data + offset, size,
+                (std::min)(offset, dictionary_size), level, i + 1 == count);
+
+            if (0 == size)
+            {
+                failed = true;
+            }
+
+            chunks[i].resize(size);
+
+            checksums[i] = adler32(adler32(0, nullptr, 0), source_data + offset, (uInt)(std::min)(chunk_size, source_length - offset));
+        });
+
+        if (failed)
+        {
+            return 0;
+        }
+
+        adler = checksums[0];
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            length += chunks[i].size();
+
+            if (i != 0)
+            {
+                adler = adler32_combine(adler, checksums[i], (z_off_t)(std::min)(chunk_size, source_length - i * chunk_size));
+            }
+        }
+
+        length += 4;
+
+        if (length > dest_length)
+        {
+            return 0;
+        }
+
+        // deflate with a 32 KB window; the header is a multiple of 31
+        dest_data[0] = 0x78;
+        dest_data[1] = (byte_t)(flags + 31 - ((0x78 * 256 + flags) % 31));
+
+        dest_data += 2;
+
+        for (const auto& chunk : chunks)
+        {
+            memcpy(dest_data, chunk.data(), chunk.size());
+
+            dest_data += chunk.size();
+        }
+
+        dest_data[0] = (byte_t)(adler >> 24);
+        dest_data[1] = (byte_t)(adler >> 16);
+        dest_data[2] = (byte_t)(adler >> 8);
+        dest_data[3] = (byte_t)adler;
+
+        return length;
+    }
+};
+
+struct zlib_library
+{
+    using stream_type = z_stream;
+
+    static int init(z_stream* strm, int level) { return deflateInit(strm, level); }
+    static int init_raw(z_stream* strm, int level) { return deflateInit2(strm, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY); }
+    static int set_dictionary(z_stream* strm, const byte_t* data, unsigned length) { return deflateSetDictionary(strm, data, length); }
+    static int reset(z_stream* strm) { return deflateReset(strm); }
+    static int deflate(z_stream* strm, int flush) { return ::deflate(strm, flush); }
+    static int end(z_stream* strm) { return deflateEnd(strm); }
+};
+
+using zlib_codec = zstream_codec<zlib_library>;
+
+#ifdef DOCPDF_USE_ZLIB_NG
+struct zlib_ng_library
+{
+    using stream_type = zng_stream;
+
+    static int init(zng_stream* strm, int level) { return zng_deflateInit(strm, level); }
+    static int init_raw(zng_stream* strm, int level) { return zng_deflateInit2(strm, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY); }
+    static int set_dictionary(zng_stream* strm, const byte_t* data, unsigned length) { return zng_deflateSetDictionary(strm, data, length); }
+    static int reset(zng_stream* strm) { return zng_deflateReset(strm); }
+    static int deflate(zng_stream* strm, int flush) { return zng_deflate(strm, flush); }
+    static int end(zng_stream* strm) { return zng_deflateEnd(strm); }
+};
+
+using zlib_ng_codec = zstream_codec<zlib_ng_library>;
+#endif
+
+#ifdef DOCPDF_USE_LIBDEFLATE
+// libdeflate compresses a whole buffer at once; each thread keeps one compressor per level
+class libdeflate_codec
+{
+    struct context
+    {
+        libdeflate_compressor* m_compressors[10]{};
+
+        ~context()
+        {
+            for (libdeflate_compressor* c : m_compressors)
+            {
+                if (c)
+                {
+                    libdeflate_free_compressor(c);
+                }
+            }
+        }
+    };
+public:
+    static size_t compress(byte_t* dest_data, size_t dest_length, const byte_t* source_data, size_t source_length, int level)
+    {
+        thread_local context ctx;
+        libdeflate_compressor*& c = ctx.m_compressors[level];
+
+        if (!c)
+        {
+            c = libdeflate_alloc_compressor(level);
+
+            if (!c)
+            {
+                return 0;
+            }
+        }
+        // the zlib format, as /FlateDecode expects
+        return libdeflate_zlib_compress(c, source_data, source_length, dest_data, dest_length);
+    }
+};
+#endif
+
 class stream_compressor
 {
+    // longer streams are compressed on several threads; see zstream_codec::compress_parallel()
+    static const size_t parallel_size = 1024 * 1024;
 public:
+    // true if a stream is worth compressing at 'level', as described in compression_profile
+    bool worth_compressing(const byte_t* source_data, size_t source_length, int level, const compression_profile& profile)
+    {
+        byte_vector sample;
+
+        if (0 == level || source_length < profile.m_min_size)
+        {
+            return false;
+        }
+        else if (0 == profile.m_sample_size || source_length <= profile.m_sample_size)
+        {
+            return true;
+        }
+
+        // the fastest level tells well enough whether the data shrinks
+        return compress(sample, source_data, profile.m_sample_size, 1) && sample.size() < profile.m_sample_size - profile.m_sample_size / 10;
+    }
     stream_compressor() = default;
     ~stream_compressor() = default;
     
+    // compresses a stream of a kind whose level in 'profile' is 'level'; false if the stream
+    // should be written uncompressed
+    bool compress(byte_vector& dest_buffer, const byte_t* source_data, size_t source_length, int level, const compression_profile& profile)
+    {
+        return worth_compressing(source_data, source_length, level, profile) && compress(dest_buffer, source_data, source_length, level);
+    }
+
 	bool compress(byte_vector& dest_buffer, const byte_t* source_data, size_t source_length, int compression_level)
 	{
-        uLongf dest_length = 0;
-        uint8_t* compressed_data;
-        int ret;
+        size_t dest_length = 0;
+
+        if (compression_level < 0 || compression_level > 9)
+        {
+            return false;
+        }
 
         try
         {
             // allocate the buffer; make it at least equal to source length
             dest_buffer.resize(source_length);
-
-            //dest_length = 0;
-            dest_length = (uLongf)dest_buffer.size();
-
-            compressed_data = dest_buffer.data();
         }
         catch (...)
         {
@@ -44,9 +539,26 @@ public:
         }
 
         // compress
-        ret = compress2(compressed_data, &dest_length, source_data, (uLong)source_length, compression_level);
+        switch (backend())
+        {
+#ifdef DOCPDF_USE_ZLIB_NG
+        case deflate_backend::zlib_ng:
+            dest_length = parallel(source_length) ? zlib_ng_codec::compress_parallel(dest_buffer.data(), dest_buffer.size(), source_data, source_length, compression_level)
+                : zlib_ng_codec::compress(dest_buffer.data(), dest_buffer.size(), source_data, source_length, compression_level);
+            break;
+#endif
+#ifdef DOCPDF_USE_LIBDEFLATE
+        case deflate_backend::libdeflate:
+            dest_length = libdeflate_codec::compress(dest_buffer.data(), dest_buffer.size(), source_data, source_length, compression_level);
+            break;
+#endif
+        default:
+            dest_length = parallel(source_length) ? zlib_codec::compress_parallel(dest_buffer.data(), dest_buffer.size(), source_data, source_length, compression_level)
+                : zlib_codec::compress(dest_buffer.data(), dest_buffer.size(), source_data, source_length, compression_level);
+            break;
+        }
 
-        if (Z_OK == ret)
+        if (dest_length != 0)
         {
             // resize to the size of the contents
             dest_buffer.resize(dest_length);
@@ -59,6 +571,58 @@ public:
             return false;
         }
 	}
-    
-    
-};
\ No newline at end of file
+    // true if a stream is long enough to be compressed on several threads; libdeflate always
+    // compresses a stream in one piece
+    static bool parallel(size_t source_length)
+    {
+        return source_length >= parallel_size && deflate_pool::instance().size() != 0;
+    }
+    // true if the library was compiled in
+    static bool available(deflate_backend library)
+    {
+        switch (library)
+        {
+        case deflate_backend::zlib:
+            return true;
+#ifdef DOCPDF_USE_ZLIB_NG
+        case deflate_backend::zlib_ng:
+            return true;
+#endif
+#ifdef DOCPDF_USE_LIBDEFLATE
+        case deflate_backend::libdeflate:
+            return true;
+#endif
+        default:
+            return false;
+        }
+    }
+    // the library that compresses the streams of all the documents from now on; false if it
+    // isn't compiled in. By default, it's libdeflate if compiled in, else zlib-ng, else zlib
+    static bool use_backend(deflate_backend library)
+    {
+        if (!available(library))
+        {
+            return false;
+        }
+
+        selected_backend() = library;
+
+        return true;
+    }
+    static deflate_backend backend()
+    {
+        return selected_backend();
+    }
+private:
+    static std::atomic<deflate_backend>& selected_backend()
+    {
+#if defined(DOCPDF_USE_LIBDEFLATE)
+        static std::atomic<deflate_backend> library{ deflate_backend::libdeflate };
+#elif defined(DOCPDF_USE_ZLIB_NG)
+        static std::atomic<deflate_backend> library{ deflate_backend::zlib_ng };
+#else
+        static std::atomic<deflate_backend> library{ deflate_backend::zlib };
+#endif
+        return library;
+    }
+};
@@ -0,0 +1,304 @@
+/*
+//  Copyright (c) 2020 Peter Frane Jr. All Rights Reserved.
+//
+//  Use of this source code is governed by the BSD 3-Clause License that can be
+//  found in the LICENSE file.
+//
+//  This software is distributed on an "AS IS" basis, WITHOUT WARRANTY
+//  OF ANY KIND, either express or implied.
+//
+//  For inquiries, email the author at pfranejr AT hotmail.com
+*/
+
+#pragma once
+#include "types.h"
+#include "compressor.hpp"
+#include <streambuf>
+
+// identifies a page content by its bytes before compression: two 64-bit hashes computed
+// differently and the length, so two different contents practically never get the same key
+struct content_key
+{
+    uint64_t m_hash1{ 14695981039346656037ULL }; // FNV-1a
+    uint64_t m_hash2{ 0 };
+    size_t m_length{ 0 };
+
+    content_key() = default;
+    explicit content_key(const byte_vector& data) : content_key(data.data(), data.size())
+    {
+    }
+    content_key(const void* data, size_t size)
+    {
+        add(data, size);
+    }
+    // hashes the next bytes of the content
+    void add(const void* data, size_t size)
+    {
+        uint64_t hash1 = m_hash1;
+        uint64_t hash2 = m_hash2;
+
+        for (const byte_t* p = (const byte_t*)data; p != (const byte_t*)data + size; ++p)
+        {
+            byte_t ch = *p;
+
+            hash1 = (hash1 ^ ch) * 1099511628211ULL;
+            hash2 = (hash2 + ch + 1) * 0x9E3779B97F4A7C15ULL;
+            hash2 ^= hash2 >> 29;
+        }
+
+        m_hash1 = hash1;
+        m_hash2 = hash2;
+        m_length += size;
+    }
+    bool operator<(const content_key& other) const
+    {
+        if (m_hash1 != other.m_hash1)
+        {
+            return m_hash1 < other.m_hash1;
+        }
+        else if (m_hash2 != other.m_hash2)
+        {
+            return m_hash2 < other.m_hash2;
+        }
+        return m_length < other.m_length;
+    }
+};
+
+// the buffer a page is drawn into through a content_writer. The page contents go through a fixed
+// window; each time it's full, its bytes are hashed and deflated, so only the compressed contents
+// are kept while the page is built. The deflate stream is reset, not recreated, for the next page.
+// The contents are kept as they are, to be compressed when the page is finished, if the level is 0
+// or the document compresses the pages in the background; see docpdf::content_level()
+class content_stream : public std::streambuf
+{
+    static const size_t window_size = 64 * 1024;
+    static const size_t min_output = 16 * 1024; // free space for deflate() to write into
+
+    enum class mode { undecided, deflate, store };
+
+    byte_vector m_window;
+    byte_vector m_data; // the contents after the window: compressed in deflate mode
+    size_t m_data_size{ 0 }; // the part of m_data in use
+    content_key m_key;
+    mode m_mode{ mode::undecided };
+    int m_level{ 0 };
+    compression_profile m_profile;
+    z_stream m_stream;
+    bool m_stream_ready{ false };
+private:
+    void reserve_data(size_t size)
+    {
+        if (m_data.size() - m_data_size < size)
+        {
+            try
+            {
+                m_data.resize((std::max)(m_data.size() * 2, m_data_size + size));
+            }
+            catch (...)
+            {
+                throw std::runtime_error("Out of memory");
+            }
+        }
+    }
+    void store(const byte_t* data, size_t size)
+    {
+        if (0 == size)
+        {
+            return;
+        }
+
+        reserve_data(size);
+
+        memcpy(m_data.data() + m_data_size, data, size);
+
+        m_data_size += size;
+    }
+    void deflate_data(const byte_t* data, size_t size, int flush)
+    {
+        int ret;
+
+        m_stream.next_in = (byte_t*)data; // not const in zlib
+        m_stream.avail_in = (unsigned)size;
+
+        do
+        {
+            reserve_data(min_output);
+
+            m_stream.next_out = m_data.data() + m_data_size;
+            m_stream.avail_out = (unsigned)(std::min)(m_data.size() - m_data_size, (size_t)UINT_MAX);
+
+            ret = deflate(&m_stream, flush);
+
+            m_data_size = m_stream.next_out - m_data.data();
+
+        } while (ret != Z_STREAM_ERROR && (0 == m_stream.avail_out || (Z_FINISH == flush && ret != Z_STREAM_END)));
+    }
+    // deflates or stores the bytes of the window; the first full window decides which
+    void empty_window()
+    {
+        const byte_t* data = m_window.data();
+        size_t size = pptr() - pbase();
+
+        m_key.add(data, size);
+
+        if (mode::undecided == m_mode)
+        {
+            stream_compressor compressor;
+
+            m_mode = (compressor.worth_compressing(data, size, m_level, m_profile) && start_stream()) ? mode::deflate : mode::store;
+        }
+
+        if (mode::deflate == m_mode)
+        {
+            deflate_data(data, size, Z_NO_FLUSH);
+        }
+        else
+        {
+            store(data, size);
+        }
+
+        reset_window();
+    }
+    void reset_window()
+    {
+        setp((char*)m_window.data(), (char*)m_window.data() + m_window.size());
+    }
+    // makes room in a full window; it's allocated when the page is first drawn into, as many
+    // pages may be constructed long before they are drawn
+    void make_room()
+    {
+        if (m_window.empty())
+        {
+            try
+            {
+                m_window.resize(window_size);
+            }
+            catch (...)
+            {
+                throw std::runtime_error("Out of memory");
+            }
+
+            reset_window();
+        }
+        else
+        {
+            empty_window();
+        }
+    }
+    bool start_stream()
+    {
+        if (!m_stream_ready)
+        {
+            memset(&m_stream, 0, sizeof(m_stream));
+
+            m_stream_ready = (deflateInit(&m_stream, m_level) == Z_OK);
+
+            return m_stream_ready;
+        }
+        // the level may differ from the last page's
+        return deflateReset(&m_stream) == Z_OK && deflateParams(&m_stream, m_level, Z_DEFAULT_STRATEGY) == Z_OK;
+    }
+protected:
+    int_type overflow(int_type ch) override
+    {
+        make_room();
+
+        if (!traits_type::eq_int_type(ch, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(ch);
+
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+    std::streamsize xsputn(const char* s, std::streamsize count) override
+    {
+        std::streamsize left = count, n;
+
+        while (left > 0)
+        {
+            if (pptr() == epptr())
+            {
+                make_room();
+            }
+
+            n = (std::min)(left, (std::streamsize)(epptr() - pptr()));
+
+            memcpy(pptr(), s, (size_t)n);
+
+            pbump((int)n);
+
+            s += n;
+            left -= n;
+        }
+        return count;
+    }
+public:
+    content_stream() : m_window(), m_data()
+    {
+    }
+    content_stream(const content_stream&) = delete;
+    content_stream& operator=(const content_stream&) = delete;
+    ~content_stream()
+    {
+        if (m_stream_ready)
+        {
+            deflateEnd(&m_stream);
+        }
+    }
+    // starts a page that is deflated at 'level' as it's built, within the limits of 'profile';
+    // a level of 0 keeps the contents as they are
+    void begin(int level, const compression_profile& profile)
+    {
+        m_level = level;
+        m_profile = profile;
+        m_mode = (0 == level) ? mode::store : mode::undecided;
+        m_key = content_key();
+    }
+    // the number of bytes written since begin()
+    size_t size() const
+    {
+        return m_key.m_length + (pptr() - pbase());
+    }
+    // ends the page: 'data' receives the contents, and 'key' identifies them. Returns true if
+    // they are compressed; otherwise, they may still be compressed as a whole
+    bool finish(byte_vector& data, content_key& key)
+    {
+        bool compressed = false;
+
+        if (mode::undecided == m_mode)
+        {
+            // the contents fit in the window; compressed at once like an image
+            m_mode = mode::store;
+        }
+
+        if (mode::deflate == m_mode)
+        {
+            size_t size = pptr() - pbase();
+
+            m_key.add(m_window.data(), size);
+
+            deflate_data(m_window.data(), size, Z_FINISH);
+
+            compressed = true;
+        }
+        else
+        {
+            empty_window();
+        }
+
+        m_data.resize(m_data_size);
+
+        data.swap(m_data);
+        key = m_key;
+
+        m_data.clear();
+        m_data_size = 0;
+
+        reset_window();
+
+        begin(m_level, m_profile);
+
+        return compressed;
+    }
+};
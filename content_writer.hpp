@@ -0,0 +1,135 @@
+/*
+//  Copyright (c) 2020 Peter Frane Jr. All Rights Reserved.
+//
+//  Use of this source code is governed by the BSD 3-Clause License that can be
+//  found in the LICENSE file.
+//
+//  This software is distributed on an "AS IS" basis, WITHOUT WARRANTY
+//  OF ANY KIND, either express or implied.
+//
+//  For inquiries, email the author at pfranejr AT hotmail.com
+*/
+
+#pragma once
+#include "types.h"
+#include <charconv>
+#include <cmath>
+#include <streambuf>
+#include <type_traits>
+
+// writes the operators of a page content into its buffer, e.g., a content_stream. The numbers are
+// formatted by std::to_chars instead of through the locale of an ostream: the reals in fixed point
+// without the trailing zeros, e.g., 612 or 0.5, and the integers without decimals
+class content_writer
+{
+    std::streambuf& m_out;
+    int m_precision{ 2 }; // the decimals of the reals
+private:
+    void write(const char* data, size_t size)
+    {
+        m_out.sputn(data, (std::streamsize)size);
+    }
+public:
+    explicit content_writer(std::streambuf& out) : m_out(out)
+    {
+    }
+    content_writer(const content_writer&) = delete;
+    content_writer& operator=(const content_writer&) = delete;
+
+    // the number of decimals of the reals, from 0 to 6
+    void precision(int decimals)
+    {
+        m_precision = (std::min)((std::max)(decimals, 0), 6);
+    }
+    int precision() const
+    {
+        return m_precision;
+    }
+    content_writer& operator<<(char ch)
+    {
+        m_out.sputc(ch);
+
+        return *this;
+    }
+    content_writer& operator<<(const char* str)
+    {
+        write(str, strlen(str));
+
+        return *this;
+    }
+    content_writer& operator<<(const std::string& str)
+    {
+        write(str.data(), str.size());
+
+        return *this;
+    }
+    content_writer& operator<<(double value)
+    {
+        char tmp[400]; // the largest double has 309 digits
+        char* end;
+        std::to_chars_result result;
+
+        if (!std::isfinite(value))
+        {
+            // to_chars would write inf or nan, which aren't PDF numbers
+            return *this << '0';
+        }
+
+        result = std::to_chars(tmp, tmp + sizeof(tmp), value, std::chars_format::fixed, m_precision);
+
+        if (result.ec != std::errc())
+        {
+            return *this << '0';
+        }
+
+        end = result.ptr;
+
+        if (m_precision > 0)
+        {
+            // remove the trailing zeros, and the point if nothing follows it
+            while ('0' == end[-1])
+            {
+                --end;
+            }
+            if ('.' == end[-1])
+            {
+                --end;
+            }
+        }
+
+        // don't write -0
+        if (2 == end - tmp && '-' == tmp[0] && '0' == tmp[1])
+        {
+            return *this << '0';
+        }
+
+        write(tmp, end - tmp);
+
+        return *this;
+    }
+    content_writer& operator<<(float value)
+    {
+        return *this << (double)value;
+    }
+    // the characters are written with operator<<(char); casting a byte_t to char writes it as is
+    template<typename integer>
+    typename std::enable_if<std::is_integral<integer>::value && (sizeof(integer) > 1) && !std::is_same<integer, bool>::value, content_writer&>::type
+        operator<<(integer value)
+    {
+        char tmp[24];
+        std::to_chars_result result = std::to_chars(tmp, tmp + sizeof(tmp), value);
+
+        write(tmp, result.ptr - tmp);
+
+        return *this;
+    }
+    // a number in base 8 with exactly three digits, e.g., an escaped character of a string
+    content_writer& octal(unsigned value)
+    {
+        const char digits[3] = { (char)('0' + ((value >> 6) & 7)), (char)('0' + ((value >> 3) & 7)), (char)('0' + (value & 7)) };
+
+        write(digits, 3);
+
+        return *this;
+    }
+};
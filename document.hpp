@@ -17,290 +17,1310 @@
 #include "fonts.hpp"
 #include "compressor.hpp"
 #include "image_manager.hpp"
+#include "output_sink.hpp"
+#include "pdf_writer.hpp"
+#include "page_tree.hpp"
+#include "pdf_reader.hpp"
+#include "linearizer.hpp"
+#include "object_copier.hpp"
+#include "content_stream.hpp"
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+
+
+// a finished page waiting for its turn to be written
+struct page_record
+{
+    bool m_skip{ false }; // the page was discarded
+    bool m_compressed{ false };
+    byte_vector m_content;
+    object_record* m_content_obj{ nullptr }; // allocated when the content was first seen; see share_identical_contents()
+    int32_t m_shared_content{ 0 }; // the content stream of an earlier page with the same content
+    content_key m_key; // split output: the content is matched when it's written
+    bool m_match_when_written{ false };
+    page_attributes m_attributes;
+    page_resources m_resources;
+    std::string m_merge_filename; // the pages of this file take the place of the page; see merge()
+};
 
-
-class page_resources
+// the pages may be built on several threads at once: each pdf_page takes a sequence number
+// when it starts, and the finished pages are written in that order
+class docpdf
 {
-    std::set<int32_t> m_font_obj_number_list;
-    std::set<int32_t> m_image_obj_number_list;
-public:
-    page_resources() : m_font_obj_number_list(), m_image_obj_number_list()
-    {
-    }
-    ~page_resources()
-    {
-        clear();
-    }
-    void clear()
-    {
-        m_font_obj_number_list.clear();
-        m_image_obj_number_list.clear();
-    }
-    bool empty() const
-    {
-        return m_font_obj_number_list.empty() && m_image_obj_number_list.empty();
-    }
-    void add_font_obj_number(int32_t m_number)
+    object_list m_obj_list;
+    page_tree m_pages;
+    font_manager m_font_mgr;
+    image_manager m_image_mgr;
+    file_sink m_file_sink{ stdout };
+    std::unique_ptr<output_sink> m_backend_sink; // the file opened by create(filename, backend) if it isn't stdio
+    output_sink* m_output{ &m_file_sink };
+    pdf_writer m_writer;
+    ULONG_PTR gdiplusToken{ 0 };
+
+    // linearized output: the document is written to a temporary file first, then rewritten to m_final_output
+    bool m_linearize{ false };
+    file_sink m_first_pass;
+    output_sink* m_final_output{ nullptr };
+
+    error_type m_last_error{ error_type::none };
+
+    bool close_file{ false };
+
+    std::mutex m_mutex; // guards everything below except m_next_sequence
+    std::atomic<uint64_t> m_next_sequence{ 0 }; // of the next page started
+    uint64_t m_commit_sequence{ 0 }; // of the next page to be written
+    std::map<uint64_t, page_record> m_pending_pages; // finished ahead of their turn
+
+    // background compression; see use_background_compression()
+    std::vector<std::thread> m_workers;
+    std::deque<std::pair<uint64_t, page_record>> m_compression_queue;
+    std::condition_variable m_queue_ready; // a page was queued, or the workers must stop
+    std::condition_variable m_queue_space; // a page was compressed
+    size_t m_max_queued_pages{ 0 }; // 0 if the pages are compressed by the threads that build them
+    size_t m_queued_pages{ 0 }; // waiting for a worker or being compressed
+    bool m_stop_workers{ false };
+
+    compression_profile m_compression; // set before create(); read without the lock afterwards
+
+    bool m_share_contents{ false };
+    std::map<content_key, int32_t> m_content_streams; // the content stream object of each distinct content
+
+    // split output; see split_output()
+    size_t m_max_part_pages{ 0 };
+    int64_t m_max_part_bytes{ 0 };
+    std::string m_part_filename; // the name passed to create()
+    int32_t m_part{ 0 }; // the part being written, from 1
+    size_t m_part_pages{ 0 }; // the pages in that part
+    bool m_part_failed{ false }; // the next part couldn't be created; the pages that follow are discarded
+
+    // merged files; see merge()
+    int32_t m_merged_files{ 0 };
+    std::map<std::string, int32_t> m_merged_fonts; // the fonts copied to the file being written, by font_key()
+
+private:
+    void start_output(output_sink& sink)
     {
-        m_font_obj_number_list.insert(m_number);
+        Gdiplus::GdiplusStartupInput gdiplusStartupInput;
+
+        m_output = &sink;
+
+        m_writer.attach(sink);
+
+        m_last_error = error_type::none;
+        m_part_failed = false;
+
+        GdiplusStartup(&gdiplusToken, &gdiplusStartupInput, NULL);
     }
-    void add_image_obj_number(int32_t m_number)
+    // the document goes to 'sink'; in linearized mode, to a temporary file first
+    bool begin_file(output_sink& sink)
     {
-        m_image_obj_number_list.insert(m_number);
+        output_sink* first_pass = &sink;
+
+        if (m_linearize)
+        {
+            if (!m_first_pass.open_temporary())
+            {
+                m_last_error = error_type::file_create_error;
+
+                return false;
+            }
+
+            m_final_output = &sink;
+
+            first_pass = &m_first_pass;
+        }
+
+        m_output = first_pass;
+
+        m_writer.attach(*first_pass);
+
+        write_header();
+
+        return true;
     }
-    void write(FILE* fp)
+    // ends the file being written with the fonts, the page tree and the xref section. The file
+    // opened by create(filename) is closed; a sink supplied by the caller is only flushed
+    void finish_file()
     {
-        std::fputs("\n\t<<\n", fp);
+        m_font_mgr.write_font(m_writer, m_obj_list, m_compression);
 
-        if (!m_font_obj_number_list.empty())
-        {
-            std::fputs("\t/Font <<\n", fp);
+        m_obj_list.write_ender(m_writer, m_pages.finish(m_obj_list, m_writer));
 
-            for (auto i : m_font_obj_number_list)
+        if (m_final_output)
+        {
+            try
+            {
+                linearize();
+            }
+            catch (...)
             {
-                // the font m_number is also the object m_number
-                std::fprintf(fp, "\t\t/F%d %d 0 R\n", i, i);
+                m_last_error = error_type::out_of_memory;
             }
-            std::fputs("\t\t>>\n", fp);
         }
-        if (!m_image_obj_number_list.empty())
+
+        if (!m_writer.flush() || !m_output->flush() || m_output->failed())
+        {
+            m_last_error = error_type::file_write_error;
+        }
+
+        m_file_sink.close();
+
+        if (m_backend_sink)
         {
-            std::fputs("\t/XObject <<\n", fp);
+            // the last writes are only known to have succeeded when it's closed
+            m_backend_sink->close();
 
-            for (auto i : m_image_obj_number_list)
+            if (m_backend_sink->failed())
             {
-                // the image m_number is also the object m_number
-                std::fprintf(fp, "\t\t/Im%d %d 0 R\n", i, i);
+                m_last_error = error_type::file_write_error;
             }
-            std::fputs("\t\t>>\n", fp);
+
+            m_backend_sink.reset();
         }
-        std::fputs("\t>>\n", fp);
+    }
+    bool split() const
+    {
+        return m_max_part_pages != 0 || m_max_part_bytes != 0;
+    }
+    // "name.pdf" becomes "name_2.pdf" for the second part
+    std::string part_filename() const
+    {
+        size_t dot = m_part_filename.find_last_of('.');
+        size_t separator = m_part_filename.find_last_of("/\\");
+        std::string suffix = "_" + std::to_string(m_part);
 
-        clear();
+        if (std::string::npos == dot || (separator != std::string::npos && dot < separator))
+        {
+            return m_part_filename + suffix;
+        }
+        return m_part_filename.substr(0, dot) + suffix + m_part_filename.substr(dot);
     }
-};
+    // closes the part being written and starts the next one; the fonts and the images are
+    // written again in the new part as its pages use them. The lock must be held
+    void next_part()
+    {
+        finish_file();
 
+        m_obj_list.restart();
+        m_pages.clear();
+        m_content_streams.clear();
+        m_merged_fonts.clear();
+        m_font_mgr.reset_objects();
+        m_image_mgr.reset_objects();
 
-class docpdf
-{
-    object_list m_obj_list;
-    page_resources m_resources;
-    font_manager m_font_mgr;
-    image_manager m_image_mgr;
-    FILE* m_output_file{ stdout };
-    ULONG_PTR gdiplusToken{ 0 };
+        ++m_part;
+        m_part_pages = 0;
 
-    error_type m_last_error{ error_type::none };
+        if (!m_file_sink.open(part_filename().c_str()))
+        {
+            m_last_error = error_type::file_create_error;
 
-    bool close_file{ false };
+            m_part_failed = true;
+        }
+        else if (!begin_file(m_file_sink))
+        {
+            m_file_sink.close();
 
-private:
+            m_part_failed = true;
+        }
+    }
     void write_header()
     {
-        std::fputs("%PDF-1.4\n%\x84\x85\x86\x87\n", m_output_file);
+        if (m_obj_list.use_object_streams())
+        {
+            m_writer.put("%PDF-1.5\n%\x84\x85\x86\x87\n");
+        }
+        else
+        {
+            m_writer.put("%PDF-1.4\n%\x84\x85\x86\x87\n");
+        }
     }
-    int32_t write_content_stream(std::ostringstream &stream)
+    // compresses the contents of a page; this is done without the lock,
+    // so the pages built on different threads are compressed in parallel
+    void compress_content(page_record& page) const
     {
-        const std::string str = stream.rdbuf()->str();
-        const byte_t* source_data = (byte_t*)str.data();
-        long source_length = (long)str.length();
-        object_record* content = m_obj_list.next_object();
         stream_compressor compressor;
         byte_vector dest_data;
 
-        stream.rdbuf()->str(std::string(""));
-        stream.clear();
-
-        content->write(m_output_file);
+        if (page.m_compressed)
+        {
+            // deflated as it was built
+            return;
+        }
+        else if (compressor.compress(dest_data, page.m_content.data(), page.m_content.size(), m_compression.m_content_level, m_compression))
+        {
+            page.m_content.swap(dest_data);
 
-        //compress_stream(source_data, source_length);
+            page.m_compressed = true;
+        }
+    }
+    int32_t write_content_stream(const page_record& page)
+    {
+        object_record* content = page.m_content_obj;
 
-        if (compressor.compress(dest_data, source_data, source_length, 9))
+        if (page.m_shared_content != 0)
         {
-            long dest_length = (long)dest_data.size();
+            // written by the earlier page
+            return page.m_shared_content;
+        }
+        else if (page.m_match_when_written)
+        {
+            // only the streams of the part being written can be shared
+            auto it = m_content_streams.find(page.m_key);
+
+            if (it != m_content_streams.end())
+            {
+                return it->second;
+            }
 
-            std::fprintf(m_output_file, "<</Length %ld/Filter /FlateDecode>>\nstream\n", dest_length);
+            content = m_obj_list.next_object();
 
-            std::fwrite(dest_data.data(), 1, dest_length, m_output_file);
+            try
+            {
+                m_content_streams.emplace(page.m_key, content->m_number);
+            }
+            catch (...)
+            {
+                throw std::runtime_error("Out of memory");
+            }
         }
-        else
+        else if (!content)
+        {
+            content = m_obj_list.next_object();
+        }
+
+        content->write(m_writer);
+
         {
-            std::fprintf(m_output_file, "<</Length %d>>\nstream\n", source_length);
+            pdf_dictionary dict(m_writer);
 
-            std::fwrite(source_data, 1, source_length, m_output_file);
+            dict.integer("/Length", (int64_t)page.m_content.size());
+
+            if (page.m_compressed)
+            {
+                dict.name("/Filter", "/FlateDecode");
+            }
         }
 
-        std::fputs("\nendstream\nendobj\n", m_output_file);
+        m_writer.put("stream\n");
+
+        m_writer.write(page.m_content.data(), page.m_content.size());
+
+        m_writer.put("\nendstream\nendobj\n");
 
         return content->m_number;
     }
 
-    void write_page_info(int32_t page_content_obj_number, real_t page_width, real_t page_height, int32_t page_rotation)
+    // allocates the objects of a font in the file being written; the lock must be held
+    void allocate_font_objects(font_record* font)
     {
-        object_record* page = m_obj_list.new_page_object();
-
+        font->m_obj_number = m_obj_list.next_object();
 
-        page->write(m_output_file);
-
-        std::fputs("<<\n/Type /Page\n/Parent 1 0 R\n", m_output_file);
+        if (!font->m_is_base_font)
+        {
+            font->m_font_descriptor_number = m_obj_list.next_object();
 
-        std::fprintf(m_output_file, "/MediaBox [0 0 %f %f]\n/Contents [%d 0 R]\n", page_width, page_height, page_content_obj_number);
+            font->m_font_file_number = m_obj_list.next_object();
+        }
+    }
+    // the object of a font in the file being written; the font is written by close(), or at the end
+    // of the part. The lock must be held
+    int32_t font_object(int32_t name)
+    {
+        font_record* font = m_font_mgr.find_number(name);
 
-        if (page_rotation != 0)
+        if (!font)
+        {
+            return 0;
+        }
+        else if (!font->m_obj_number)
         {
-            std::fprintf(m_output_file, "/Rotation %d\n", page_rotation);
+            allocate_font_objects(font);
         }
 
-        std::fputs("/Resources ", m_output_file);
+        font->in_use(true);
+
+        return font->m_obj_number->m_number;
+    }
+    // the object of an image in the file being written. An image is written with the first page
+    // that uses it, and again in each part of a split document that uses it. The lock must be held
+    int32_t image_object(int32_t name)
+    {
+        int32_t number = m_image_mgr.image_object(name);
+        object_record* obj;
 
-        if (m_resources.empty())
+        if (number != 0)
         {
-            std::fputs("<<>>\n", m_output_file);
+            return number;
         }
-        else
+        else if (0 == m_image_mgr.object_size(name, m_compression))
         {
-            m_resources.write(m_output_file);
+            return 0;
         }
 
-        std::fputs(">>\nendobj\n", m_output_file);
-    }
+        obj = m_obj_list.next_object();
 
+        obj->write(m_writer);
 
-public:
-    docpdf() : m_obj_list(), m_resources(), m_font_mgr(), m_image_mgr()
-    {
+        m_image_mgr.write_image(name, obj->m_number, m_writer);
 
+        return obj->m_number;
     }
-
-    ~docpdf()
+    // the bytes that the images of a page add to the file being written: the images it doesn't
+    // have yet, with their first lines and their xref entries. The lock must be held
+    int64_t images_size(const page_resources& resources)
     {
-        close();
+        const int64_t line_size = 20; // "2147483647 0 obj\n" at most
+        const int64_t xref_entry_size = 20;
+        int64_t size = 0;
+
+        resources.for_each_image([&](int32_t name)
+            {
+                size_t object_size = m_image_mgr.object_size(name, m_compression);
+
+                if (object_size != 0)
+                {
+                    size += (int64_t)object_size + line_size + xref_entry_size;
+                }
+            });
+
+        return size;
     }
+    void write_page_info(int32_t page_content_obj_number, page_record& page_info)
+    {
+        page_info.m_resources.set_objects([this](int32_t name) { return font_object(name); },
+            [this](int32_t name) { return image_object(name); });
 
+        // the MediaBox, the Rotate and the Resources are inherited from the parent node
+        object_record* page = m_pages.add_page(page_info.m_attributes, page_info.m_resources, m_obj_list, m_writer);
 
-    void close()
+        pdf_dictionary(m_obj_list.begin_object(page, m_writer)).name("/Type", "/Page").ref("/Parent", m_pages.parent())
+            .refs("/Contents", int_vector{ page_content_obj_number });
+
+        m_obj_list.end_object(m_writer);
+    }
+    // true if a page that adds 'content_size' bytes, its content and its new images, doesn't fit in the part
+    // being written. The size of the part includes the page and the xref table, but not the fonts and the
+    // page tree, which are written at the end
+    bool part_full(int64_t content_size) const
     {
-        if (!close_file)
+        const int64_t xref_entry_size = 20;
+
+        if (0 == m_part_pages)
+        {
+            return false;
+        }
+        else if (m_max_part_pages != 0 && m_part_pages >= m_max_part_pages)
+        {
+            return true;
+        }
+        return m_max_part_bytes != 0
+            && m_writer.offset() + content_size + xref_entry_size * (m_obj_list.object_count() + 3) >= m_max_part_bytes;
+    }
+    // writes a finished page, in a new part if the one being written is full; the lock must be held
+    void commit_page(page_record& page)
+    {
+        if (m_part_failed)
+        {
+            return;
+        }
+        else if (!page.m_merge_filename.empty())
         {
-            m_font_mgr.write_font(m_output_file);
+            merge_file(page.m_merge_filename);
 
-            m_obj_list.write_ender(m_output_file);
+            return;
+        }
+        else if (part_full((int64_t)page.m_content.size() + (m_max_part_bytes != 0 ? images_size(page.m_resources) : 0)))
+        {
+            next_part();
+        }
 
-            if (m_output_file && m_output_file != stdout)
-            {
-                std::fclose(m_output_file);
+        ++m_part_pages;
 
-                m_output_file = stdout;
-            }
+        write_page_info(write_content_stream(page), page);
+    }
+    // a merged font is identified by its /BaseFont and the hash of its font file, if it has one
+    static bool font_key(pdf_reader& reader, int32_t number, std::string& key)
+    {
+        std::string font, descriptor, dict, data;
+        int32_t font_file;
+        bool is_stream;
 
-            m_obj_list.clear();
-            m_resources.clear();
-            m_font_mgr.clear();
-            m_image_mgr.clear();
+        if (!reader.read_object(number, font) || !pdf_reader::get_name(font, "/BaseFont", key))
+        {
+            return false;
+        }
 
-            Gdiplus::GdiplusShutdown(gdiplusToken);
-        
-            close_file = true;
+        if (pdf_reader::get_ref(font, "/FontDescriptor", font_file) && reader.read_object(font_file, descriptor)
+            && (pdf_reader::get_ref(descriptor, "/FontFile", font_file) || pdf_reader::get_ref(descriptor, "/FontFile2", font_file)
+                || pdf_reader::get_ref(descriptor, "/FontFile3", font_file))
+            && reader.read_raw_object(font_file, dict, data, is_stream))
+        {
+            // the font file as it's stored: the same font compressed differently is copied twice
+            content_key hash(data.data(), data.size());
+
+            key += ' ' + std::to_string(hash.m_hash1) + ' ' + std::to_string(hash.m_hash2) + ' ' + std::to_string(hash.m_length);
         }
+        return true;
     }
-
-    bool create(const char* filename)
+    // the copy of a font of a merged file; the same font copied from an earlier file is used instead.
+    // The lock must be held
+    int32_t merged_font(pdf_reader& reader, object_copier& copier, int32_t number)
     {
-        if (!filename)
+        std::string key;
+        int32_t copy = copier.find(number);
+
+        if (copy != 0)
         {
-            m_last_error = error_type::missing_filename;
+            return copy;
         }
-        
-        else
+        else if (!font_key(reader, number, key))
         {
-            FILE* tmp = nullptr;
+            return copier.copy(number);
+        }
 
-            fopen_s(&tmp, filename, "wb");
+        {
+            auto it = m_merged_fonts.find(key);
 
-            if (!tmp)
+            if (it != m_merged_fonts.end())
             {
-                m_last_error = error_type::file_create_error;
+                copier.map(number, it->second);
+
+                return it->second;
             }
-            else
-            {
-                Gdiplus::GdiplusStartupInput gdiplusStartupInput;
+        }
 
-                m_output_file = tmp;
+        copy = copier.copy(number);
 
-                write_header();
+        try
+        {
+            m_merged_fonts.emplace(key, copy);
+        }
+        catch (...)
+        {
+            throw std::runtime_error("Out of memory");
+        }
 
-                m_last_error = error_type::none;
+        return copy;
+    }
+    // copies a page of a merged file with its contents and resources; the lock must be held
+    bool merge_page(pdf_reader& reader, object_copier& copier, const std::string& dict, const page_attributes& attributes, const std::string& resources)
+    {
+        page_resources used;
+        int_vector contents;
+        std::string fonts, images;
+        object_record* page;
 
-                GdiplusStartup(&gdiplusToken, &gdiplusStartupInput, NULL);
+        if (part_full(0))
+        {
+            next_part();
 
-                return true;
+            if (m_part_failed)
+            {
+                return false;
             }
+
+            // the copies and the fonts are written again in the new part
+            copier.clear();
         }
 
-        return false;
-    }
-    void write_page(std::ostringstream &stream, real_t page_width, real_t page_height, int32_t page_rotation)
-    {
-        int32_t page_content_obj_number;
+        ++m_part_pages;
+
+        // the names are /F and /Im followed by a number, like those of the pages built by the document
+        pdf_reader::get_dictionary(resources, "/Font", fonts);
+        pdf_reader::get_dictionary(resources, "/XObject", images);
+
+        pdf_reader::scan_refs(fonts, [&](const std::string& key, int32_t ref)
+            {
+                if (0 == key.compare(0, 2, "/F"))
+                {
+                    used.add_font(atoi(key.c_str() + 2), merged_font(reader, copier, ref));
+                }
+                return ref;
+            }, nullptr);
 
-        page_content_obj_number = write_content_stream(stream);
+        pdf_reader::scan_refs(images, [&](const std::string& key, int32_t ref)
+            {
+                if (0 == key.compare(0, 3, "/Im"))
+                {
+                    used.add_image(atoi(key.c_str() + 3), copier.copy(ref));
+                }
+                return ref;
+            }, nullptr);
+
+        pdf_reader::scan_refs(dict, [&](const std::string& key, int32_t ref)
+            {
+                if ("/Contents" == key)
+                {
+                    contents.push_back(copier.copy(ref));
+                }
+                return ref;
+            }, nullptr);
+
+        page = m_pages.add_page(attributes, used, m_obj_list, m_writer);
 
+        pdf_dictionary(m_obj_list.begin_object(page, m_writer)).name("/Type", "/Page").ref("/Parent", m_pages.parent()).refs("/Contents", contents);
 
-        write_page_info(page_content_obj_number, page_width, page_height, page_rotation);
+        m_obj_list.end_object(m_writer);
+
+        return copier.flush(m_writer);
     }
-    font_record* find_font(const char* m_basefont)
+    // copies the pages below a page tree node of a merged file; the lock must be held
+    bool merge_node(pdf_reader& reader, object_copier& copier, int32_t number, page_attributes attributes, std::string resources, int depth)
     {
-        font_record* font = m_font_mgr.find_font(m_basefont);
+        std::string dict, value;
+        std::vector<double> box;
+        int_vector kids;
+        int64_t rotation;
+        int32_t ref;
 
-        if (font)
+        if (depth > 64 || !reader.read_object(number, dict))
         {
-            if (0 == font->m_number)
+            return false;
+        }
+
+        // the attributes inherited by the pages
+        if (pdf_reader::get_real_array(dict, "/MediaBox", box) && 4 == box.size())
+        {
+            attributes.m_width = (real_t)(box[2] - box[0]);
+            attributes.m_height = (real_t)(box[3] - box[1]);
+        }
+        if (pdf_reader::get_int(dict, "/Rotate", rotation))
+        {
+            attributes.m_rotation = (int32_t)rotation;
+        }
+        if (pdf_reader::get_ref(dict, "/Resources", ref))
+        {
+            if (!reader.read_object(ref, resources))
             {
-                font->m_obj_number = m_obj_list.next_object();                
+                return false;
+            }
+        }
+        else if (pdf_reader::get_dictionary(dict, "/Resources", value))
+        {
+            resources.swap(value);
+        }
 
-                font->m_number = font->m_obj_number->m_number;
+        if (dict.find("/Kids") == std::string::npos)
+        {
+            return merge_page(reader, copier, dict, attributes, resources);
+        }
 
-                if (!font->m_is_base_font)
+        pdf_reader::scan_refs(dict, [&](const std::string& key, int32_t kid)
+            {
+                if ("/Kids" == key)
                 {
-                    font->m_font_descriptor_number = m_obj_list.next_object();
-
-                    font->m_font_file_number = m_obj_list.next_object();
+                    kids.push_back(kid);
                 }
+                return kid;
+            }, nullptr);
 
+        for (int32_t kid : kids)
+        {
+            if (!merge_node(reader, copier, kid, attributes, resources, depth + 1))
+            {
+                return false;
             }
+        }
+        return true;
+    }
+    // copies the pages of a merged file to the file being written; see merge(). The lock must be held
+    void merge_file(const std::string& filename)
+    {
+        pdf_reader reader;
+        object_copier copier(reader, m_obj_list);
+        page_attributes attributes;
+        std::string catalog;
+        int32_t root;
 
-            // add this to the page resource m_list
-            m_resources.add_font_obj_number(font->m_number);
+        // the pages of each file get their own leaf nodes
+        attributes.m_group = ++m_merged_files;
 
-            return font;
+        if (!reader.open(filename.c_str()))
+        {
+            m_last_error = error_type::file_open_failed;
         }
+        else if (!reader.read_trailer() || !reader.load_xref() || !reader.read_object(reader.root(), catalog)
+            || !pdf_reader::get_ref(catalog, "/Pages", root) || !merge_node(reader, copier, root, attributes, std::string(), 0))
+        {
+            if (m_part_failed)
+            {
+                // the error is that of the part
+                return;
+            }
 
-        return nullptr;
+            m_last_error = error_type::invalid_file;
+
+            // the copies allocated so far must be written
+            copier.flush(m_writer);
+        }
     }
-    int32_t find_image(const char* filename)
+    // writes the pages whose turn has come; the lock must be held
+    void commit_pages()
     {
-        int object_number = m_image_mgr.find_image(filename);
+        auto it = m_pending_pages.begin();
 
-        if (NOTFOUND == object_number)
+        while (it != m_pending_pages.end() && it->first == m_commit_sequence)
         {
-            object_record* obj = m_obj_list.next_object();
-
-            obj->write(m_output_file);
-
-            if (m_image_mgr.add_image(filename, obj->m_number, m_output_file))
+            if (!it->second.m_skip)
             {
-                m_resources.add_image_obj_number(obj->m_number);
-
-                return obj->m_number;
+                commit_page(it->second);
             }
-            // close the object in case of failure to avoid a corrupt file
-            std::fputs("endob\n", m_output_file);
+
+            it = m_pending_pages.erase(it);
+
+            ++m_commit_sequence;
         }
-        else
+    }
+    // the lock must be held
+    void add_pending_page(uint64_t sequence, page_record& page)
+    {
+        try
+        {
+            m_pending_pages.emplace(sequence, std::move(page));
+        }
+        catch (...)
         {
-            m_resources.add_image_obj_number(object_number);
+            throw std::runtime_error("Out of memory");
         }
-        return object_number;
+
+        commit_pages();
+    }
+    void compression_worker()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        for (;;)
+        {
+            std::pair<uint64_t, page_record> item;
+
+            m_queue_ready.wait(lock, [this] { return m_stop_workers || !m_compression_queue.empty(); });
+
+            if (m_compression_queue.empty())
+            {
+                return;
+            }
+
+            item.first = m_compression_queue.front().first;
+            item.second = std::move(m_compression_queue.front().second);
+
+            m_compression_queue.pop_front();
+
+            lock.unlock();
+
+            compress_content(item.second);
+
+            lock.lock();
+
+            --m_queued_pages;
+
+            m_queue_space.notify_one();
+
+            try
+            {
+                add_pending_page(item.first, item.second);
+            }
+            catch (...)
+            {
+                m_last_error = error_type::out_of_memory;
+            }
+        }
+    }
+    // rewrites the first pass to the final output
+    void linearize()
+    {
+        std::vector<int64_t> offsets;
+        linearizer rewriter;
+        bool result;
+
+        result = m_writer.flush() && m_first_pass.flush() && !m_first_pass.failed() && m_obj_list.get_offsets(offsets);
+
+        m_output = m_final_output;
+
+        m_writer.attach(*m_final_output);
+
+        if (!result || !rewriter.write(m_first_pass.file(), offsets, m_obj_list.xref_offset(), m_obj_list.catalog_number(), m_writer))
+        {
+            m_last_error = error_type::file_write_error;
+        }
+
+        m_first_pass.close();
+
+        m_final_output = nullptr;
+    }
+    // waits for the queued pages to be compressed
+    void stop_workers()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            m_stop_workers = true;
+        }
+
+        m_queue_ready.notify_all();
+
+        for (auto& worker : m_workers)
+        {
+            worker.join();
+        }
+
+        m_workers.clear();
+    }
+
+
+public:
+    docpdf() : m_obj_list(), m_pages(), m_font_mgr(), m_image_mgr()
+    {
+        m_writer.attach(m_file_sink);
+    }
+
+    ~docpdf()
+    {
+        close();
+    }
+
+
+    void close()
+    {
+        stop_workers();
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (!close_file)
+        {
+            // the pages still waiting for one that was never finished
+            for (auto& it : m_pending_pages)
+            {
+                if (!it.second.m_skip)
+                {
+                    commit_page(it.second);
+                }
+            }
+            m_pending_pages.clear();
+
+            if (!m_part_failed)
+            {
+                finish_file();
+            }
+
+            m_output = &m_file_sink;
+
+            m_writer.attach(m_file_sink);
+
+            m_obj_list.clear();
+            m_pages.clear();
+            m_content_streams.clear();
+            m_merged_fonts.clear();
+            m_font_mgr.clear();
+            m_image_mgr.clear();
+
+            Gdiplus::GdiplusShutdown(gdiplusToken);
+        
+            close_file = true;
+        }
+    }
+
+    // writes a PDF 1.5 file with compressed object streams and a cross-reference stream;
+    // smaller, but needs a PDF 1.5 reader. Must be called before create()
+    bool use_object_streams(bool value)
+    {
+        if (m_writer.offset() != 0 || (value && m_linearize))
+        {
+            m_last_error = error_type::invalid_parameter;
+
+            return false;
+        }
+
+        m_obj_list.use_object_streams(value);
+
+        return true;
+    }
+    // writes a linearized file: the first page and the hint tables come first, so a viewer can show
+    // the first page before the rest of the file arrives. The document is written to a temporary file,
+    // and rewritten to the output by close(). Can't be used with object streams or append().
+    // Must be called before create()
+    bool use_linearization(bool value)
+    {
+        if (m_writer.offset() != 0 || (value && m_obj_list.use_object_streams()))
+        {
+            m_last_error = error_type::invalid_parameter;
+
+            return false;
+        }
+
+        m_linearize = value;
+
+        return true;
+    }
+    // sets how the page contents, the images and the font files are compressed, e.g.,
+    // compression_profile::fastest() for documents made while the user waits, or
+    // compression_profile::smallest(), the default, for archiving. Must be called before create()
+    bool use_compression_profile(const compression_profile& profile)
+    {
+        if (m_writer.offset() != 0 || !profile.valid())
+        {
+            m_last_error = error_type::invalid_parameter;
+
+            return false;
+        }
+
+        m_compression = profile;
+
+        m_obj_list.use_compression_profile(profile);
+
+        return true;
+    }
+    // the pages with the same content as an earlier page refer to its content stream instead of
+    // compressing and writing it again, e.g., blank separator pages or repeated cover sheets.
+    // The contents are hashed before compression. Must be called before create()
+    bool share_identical_contents(bool value)
+    {
+        if (m_writer.offset() != 0)
+        {
+            m_last_error = error_type::invalid_parameter;
+
+            return false;
+        }
+
+        m_share_contents = value;
+
+        return true;
+    }
+    // writes the document as several files, each one a complete PDF. A new file is started before
+    // a page when the current one has 'max_pages' pages, or when the page, with its content and the
+    // images it adds, would take it past 'max_bytes' bytes; 0 means no limit. Not counted: the fonts
+    // and the page tree, written at the end of the part, so leave some room for them; the objects
+    // copied with the pages of a merged file; and a page that doesn't fit in an empty part, which
+    // gets a part of its own. The files are named after the one passed to create(filename):
+    // "name_1.pdf", "name_2.pdf", etc. Each part holds only the fonts and the images its pages use.
+    // Must be called before create(filename)
+    bool split_output(size_t max_pages, int64_t max_bytes)
+    {
+        if (m_writer.offset() != 0 || max_bytes < 0)
+        {
+            m_last_error = error_type::invalid_parameter;
+
+            return false;
+        }
+
+        m_max_part_pages = max_pages;
+        m_max_part_bytes = max_bytes;
+
+        return true;
+    }
+    // the number of files written by a split document
+    int32_t part_count() const
+    {
+        return m_part;
+    }
+    // keeps the offsets of the written objects in a temporary file, so the memory use
+    // stays flat however many objects the document has
+    bool spill_object_table()
+    {
+        if (!m_obj_list.spill_to_file())
+        {
+            m_last_error = error_type::file_create_error;
+
+            return false;
+        }
+        return true;
+    }
+    // compresses the page contents on 'threads' background threads, so showpage returns as soon
+    // as the page is queued. When 'max_pages' pages are waiting to be compressed, showpage blocks
+    // until one of them is done. Must be called before create()
+    bool use_background_compression(size_t threads, size_t max_pages)
+    {
+        if (m_writer.offset() != 0 || !m_workers.empty() || 0 == threads || 0 == max_pages)
+        {
+            m_last_error = error_type::invalid_parameter;
+
+            return false;
+        }
+
+        m_max_queued_pages = max_pages;
+
+        try
+        {
+            for (size_t i = 0; i < threads; ++i)
+            {
+                m_workers.emplace_back(&docpdf::compression_worker, this);
+            }
+        }
+        catch (...)
+        {
+            // run with the threads that could be started
+            if (m_workers.empty())
+            {
+                m_max_queued_pages = 0;
+            }
+        }
+
+        return true;
+    }
+    // 'backend' chooses how the file is written: through stdio, on a background thread, or through
+    // a memory-mapped file; the last two keep the disk writes off the threads that build the pages.
+    // A split document is written through stdio
+    bool create(const char* filename, file_backend backend = file_backend::stdio)
+    {
+        if (!filename)
+        {
+            m_last_error = error_type::missing_filename;
+        }
+        else if (backend != file_backend::stdio)
+        {
+            bool result = false;
+
+            if (split())
+            {
+                m_last_error = error_type::invalid_parameter;
+
+                return false;
+            }
+
+            try
+            {
+                if (file_backend::async == backend)
+                {
+                    std::unique_ptr<async_file_sink> sink(new async_file_sink());
+
+                    result = sink->open(filename);
+
+                    m_backend_sink = std::move(sink);
+                }
+                else
+                {
+                    std::unique_ptr<mapped_file_sink> sink(new mapped_file_sink());
+
+                    result = sink->open(filename);
+
+                    m_backend_sink = std::move(sink);
+                }
+            }
+            catch (...)
+            {
+                m_last_error = error_type::out_of_memory;
+
+                return false;
+            }
+
+            if (!result)
+            {
+                m_backend_sink.reset();
+
+                m_last_error = error_type::file_create_error;
+
+                return false;
+            }
+
+            return create(*m_backend_sink);
+        }
+        else
+        {
+            if (split())
+            {
+                m_part_filename = filename;
+                m_part = 1;
+            }
+
+            if (!m_file_sink.open(split() ? part_filename().c_str() : filename))
+            {
+                m_last_error = error_type::file_create_error;
+            }
+            else
+            {
+                return create(m_file_sink);
+            }
+        }
+
+        return false;
+    }
+    // writes the document to the given sink, e.g., a memory_sink or a stream_sink;
+    // the sink must stay alive until close() is called
+    bool create(output_sink& sink)
+    {
+        if (split() && &sink != &m_file_sink)
+        {
+            // the parts are files
+            m_last_error = error_type::invalid_parameter;
+
+            return false;
+        }
+
+        start_output(sink);
+
+        return begin_file(sink);
+    }
+    // opens a file written by this library and adds the new pages to it as an incremental update.
+    // Only the trailer, the catalog and the root of the page tree are read; the existing pages are
+    // neither read nor written again, and their fonts are not shared with the new pages
+    bool append(const char* filename)
+    {
+        pdf_reader reader;
+        std::string catalog, root;
+        int32_t page_tree_root = 0;
+        int64_t page_count = 0;
+
+        if (!filename)
+        {
+            m_last_error = error_type::missing_filename;
+        }
+        else if (m_linearize || split())
+        {
+            m_last_error = error_type::invalid_parameter;
+        }
+        else if (!reader.open(filename))
+        {
+            m_last_error = error_type::file_open_failed;
+        }
+        else if (!reader.read_trailer() || !reader.read_object(reader.root(), catalog)
+            || !pdf_reader::get_ref(catalog, "/Pages", page_tree_root) || !reader.read_object(page_tree_root, root)
+            || !pdf_reader::get_int(root, "/Count", page_count))
+        {
+            m_last_error = error_type::invalid_file;
+        }
+        else
+        {
+            reader.close();
+
+            if (!m_file_sink.open_append(filename))
+            {
+                m_last_error = error_type::file_open_failed;
+
+                return false;
+            }
+
+            m_obj_list.append_to(reader.size(), reader.root(), reader.startxref(), reader.xref_stream(), reader.pdf15());
+
+            start_output(m_file_sink);
+
+            // the file ends with %%EOF
+            m_writer.put('\n');
+
+            // the old root gets a parent
+            {
+                int32_t parent = m_pages.append_to(page_tree_root, page_count, m_obj_list);
+                pdf_writer& out = m_obj_list.begin_object(m_obj_list.update_object(page_tree_root), m_writer);
+
+                out.put("<</Parent ").put_ref(parent).put('\n').write(root.data() + 2, root.size() - 2).put('\n');
+
+                m_obj_list.end_object(m_writer);
+            }
+
+            return true;
+        }
+
+        return false;
+    }
+    // copies the pages of a file written by this library, e.g., a part of the document rendered by another
+    // process, to the place of a page begun now: they come after the pages begun before the call.
+    // The contents, the images and the font files are copied as they are stored, without decompressing
+    // them; only their dictionaries are renumbered, and the page tree and the xref section are built anew.
+    // A font used by several merged files is written once: the fonts are matched by /BaseFont and by
+    // the hash of the font file. Only the trailer of the file is read here; the pages are copied when
+    // their turn comes, and an error is reported by get_error()
+    bool merge(const char* filename)
+    {
+        pdf_reader reader;
+        page_record page;
+
+        if (!filename)
+        {
+            m_last_error = error_type::missing_filename;
+        }
+        else if (!reader.open(filename))
+        {
+            m_last_error = error_type::file_open_failed;
+        }
+        else if (!reader.read_trailer())
+        {
+            m_last_error = error_type::invalid_file;
+        }
+        else
+        {
+            uint64_t sequence;
+
+            reader.close();
+
+            try
+            {
+                page.m_merge_filename = filename;
+            }
+            catch (...)
+            {
+                throw std::runtime_error("Out of memory");
+            }
+
+            sequence = begin_page();
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            if (!close_file)
+            {
+                add_pending_page(sequence, page);
+            }
+
+            return true;
+        }
+
+        return false;
+    }
+    // the level at which the pages are deflated as they are built, or 0 if they are compressed
+    // when they are finished: in the background, or by a library other than zlib
+    int content_level() const
+    {
+        if (m_max_queued_pages != 0 || stream_compressor::backend() != deflate_backend::zlib)
+        {
+            return 0;
+        }
+        return m_compression.m_content_level;
+    }
+    const compression_profile& compression() const
+    {
+        return m_compression;
+    }
+    // reserves the place of a new page in the document
+    uint64_t begin_page()
+    {
+        return m_next_sequence++;
+    }
+    // writes the page started by begin_page() once the pages before it have been written;
+    // may be called from any thread
+    void write_page(uint64_t sequence, content_stream& content, real_t page_width, real_t page_height, int32_t page_rotation, page_resources& resources)
+    {
+        page_record page;
+        content_key key;
+
+        page.m_compressed = content.finish(page.m_content, key);
+
+        page.m_attributes.m_width = page_width;
+        page.m_attributes.m_height = page_height;
+        page.m_attributes.m_rotation = page_rotation;
+
+        page.m_resources = std::move(resources);
+
+        resources.clear();
+
+        if (m_share_contents && split())
+        {
+            // a page may be written in a later part than the one its content would be shared with,
+            // so the content is matched when it's written, after the compression
+            page.m_key = key;
+            page.m_match_when_written = true;
+        }
+        else if (m_share_contents)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_content_streams.find(key);
+
+            if (close_file)
+            {
+                return;
+            }
+            else if (it != m_content_streams.end())
+            {
+                page.m_shared_content = it->second;
+
+                page.m_content.clear();
+
+                add_pending_page(sequence, page);
+
+                return;
+            }
+
+            // the object is allocated now, so the next pages with this content can refer to it
+            page.m_content_obj = m_obj_list.next_object();
+
+            try
+            {
+                m_content_streams.emplace(key, page.m_content_obj->m_number);
+            }
+            catch (...)
+            {
+                throw std::runtime_error("Out of memory");
+            }
+        }
+
+        if (0 == m_max_queued_pages)
+        {
+            compress_content(page);
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            if (!close_file)
+            {
+                add_pending_page(sequence, page);
+            }
+        }
+        else
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+
+            // the compressed pages that finished ahead of their turn are not counted; the workers
+            // never wait for them, so a page held up by the thread building it can't block the queue
+            m_queue_space.wait(lock, [this] { return m_queued_pages < m_max_queued_pages || close_file; });
+
+            if (!close_file)
+            {
+                try
+                {
+                    m_compression_queue.emplace_back(sequence, std::move(page));
+                }
+                catch (...)
+                {
+                    throw std::runtime_error("Out of memory");
+                }
+
+                ++m_queued_pages;
+
+                m_queue_ready.notify_one();
+            }
+        }
+    }
+    // the page started by begin_page() won't be written
+    void cancel_page(uint64_t sequence)
+    {
+        page_record page;
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        page.m_skip = true;
+
+        if (!close_file)
+        {
+            add_pending_page(sequence, page);
+        }
+    }
+    error_type get_error() const
+    {
+        return m_last_error;
+    }
+    font_record* find_font(const char* m_basefont)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        font_record* font = m_font_mgr.find_font(m_basefont);
+
+        if (font)
+        {
+            if (0 == font->m_number)
+            {
+                allocate_font_objects(font);
+
+                font->m_number = font->m_obj_number->m_number;
+            }
+
+            return font;
+        }
+
+        return nullptr;
+    }
+    // the name of an image; it's written with the first page that uses it
+    int32_t find_image(const char* filename)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        return m_image_mgr.find_image(filename, m_compression);
     }
 };
 
@@ -14,6 +14,8 @@
 #include "types.h"
 #include "matrix.hpp"
 #include "compressor.hpp"
+#include "pdf_writer.hpp"
+#include "objects.hpp"
 
 struct font_record
 {
@@ -37,7 +39,6 @@ struct font_record
     object_record* m_obj_number{ nullptr };
     object_record *m_font_descriptor_number{ nullptr };
     object_record* m_font_file_number{ nullptr };
-    matrix m_matrix;
     real_t m_em_square{ 1000.0f };
     real_t m_italic_angle{ 0.0f };// todo
     real_t m_stemV{ 80.0f };//guessed
@@ -46,7 +47,7 @@ struct font_record
 #ifdef _WIN32
     HFONT m_hfont{ nullptr };
 #endif
-    font_record() : m_subtype(), m_basefont(), m_font_path(), m_matrix(), m_type1_full_path()
+    font_record() : m_subtype(), m_basefont(), m_font_path(), m_type1_full_path()
     {}
     virtual ~font_record()
     {
@@ -83,69 +84,39 @@ struct font_record
         }
         return 0;
     }
-    real_t scaled_width(uint8_t c)
+    // the metrics scaled to a font size; the size is kept by the graphics state,
+    // since the records are shared by all the pages
+    real_t scaled_width(uint8_t c, real_t size)
     {
-        return real_t(width((uint8_t)c)) * size() / em_square();
+        return real_t(width((uint8_t)c)) * size / em_square();
     }
-    real_t scaled_width(uint32_t c)
+    real_t scaled_width(uint32_t c, real_t size)
     {
-        return real_t(width((uint32_t)c)) * size() / em_square();
+        return real_t(width((uint32_t)c)) * size / em_square();
     }
-    real_t size() const
+    real_t ascent(real_t size) const
     {
-        return m_matrix.sy;
+        return real_t(m_ascent) * size / m_em_square;
     }
-    void scale(real_t new_size)
+    real_t descent(real_t size) const
     {
-        m_matrix.sx = m_matrix.sy = new_size;
-    }
-    void scale(real_t width, real_t height)
-    {
-        m_matrix.sx = width;
-        m_matrix.sy = height;
-    }
-    real_t ascent(bool scaled = true) const
-    {
-        if (scaled)
-            return real_t(m_ascent) * size() / m_em_square;
-        else
-            return real_t(m_ascent);
-    }
-    real_t descent(bool scaled = true) const
-    {
-        if (scaled)
-            return real_t(m_descent) * size() / m_em_square;
-        else
-            return real_t(m_descent);
+        return real_t(m_descent) * size / m_em_square;
     }
     real_t em_square() const
     {
         return m_em_square;
     }
-    real_t height(bool scaled = true)
-    {
-        if (scaled)
-            return ascent() + fabs(descent());
-        else
-            return real_t(m_ascent) + fabs(real_t(m_descent));
-    }
-    real_t internal_leading(bool scaled = true) const
+    real_t height(real_t size) const
     {
-        if (scaled)
-            return real_t(m_internal_leading) * size() / m_em_square;
-        else
-            return real_t(m_internal_leading);
+        return ascent(size) + fabs(descent(size));
     }
-    real_t external_leading(bool scaled = true) const
+    real_t internal_leading(real_t size) const
     {
-        if (scaled)
-            return real_t(m_external_leading) * size() / m_em_square;
-        else
-            return real_t(m_external_leading);
+        return real_t(m_internal_leading) * size / m_em_square;
     }
-    matrix transform() const
+    real_t external_leading(real_t size) const
     {
-        return m_matrix;
+        return real_t(m_external_leading) * size / m_em_square;
     }
     void in_use(bool value)
     {
@@ -159,76 +130,65 @@ struct font_record
     {
         return m_number;
     }
-    void write_font_descriptor(FILE* fp)
+    void write_font_descriptor(pdf_writer& doc, object_list& objects)
     {
-        m_font_descriptor_number->write(fp);
+        pdf_dictionary dict(objects.begin_object(m_font_descriptor_number, doc));
 
-        fprintf(fp, "<</Type /FontDescriptor\n/FontName /%s\n", m_basefont.c_str());
+        dict.name("/Type", "/FontDescriptor").name("/FontName", m_basefont);
 
-        fprintf(fp, "/FontBBox [%d %d %d %d]\n", m_font_bbox[0], m_font_bbox[1], m_font_bbox[2], m_font_bbox[3]);
+        dict.integers("/FontBBox", m_font_bbox, 4);
 
-        fprintf(fp, "/Flags %d\n", 4);// font->m_flag);
+        dict.integer("/Flags", 4);// font->m_flag);
 
-        fprintf(fp, "/Ascent %d\n", m_ascent);// font->m_ascent);
+        dict.integer("/Ascent", m_ascent);// font->m_ascent);
 
-        fprintf(fp, "/Descent %d\n", m_descent);// font->m_descent);
+        dict.integer("/Descent", m_descent);// font->m_descent);
 
-        fprintf(fp, "/ItalicAngle %f\n", m_italic_angle);
+        dict.real("/ItalicAngle", m_italic_angle);
 
-        fprintf(fp, "/StemV %f\n", m_stemV);
+        dict.real("/StemV", m_stemV);
 
-        fprintf(fp, "/CapHeight %d\n", m_cap_height);// font->m_capheight);
+        dict.integer("/CapHeight", m_cap_height);// font->m_capheight);
 
         if (m_subtype == "Type1")
         {
-            fprintf(fp, "/FontFile %d 0 R\n", m_font_file_number->m_number);
+            dict.ref("/FontFile", m_font_file_number->m_number);
         }
         else if (m_subtype == "TrueType")
         {
-            fprintf(fp, "/FontFile2 %d 0 R\n", m_font_file_number->m_number);
+            dict.ref("/FontFile2", m_font_file_number->m_number);
         }
         else
         {
-            fprintf(fp, "/FontFile3 %d 0 R\n", m_font_file_number->m_number);
+            dict.ref("/FontFile3", m_font_file_number->m_number);
         }
-        fputs(">>\nendobj\n", fp);
+        dict.end();
+
+        objects.end_object(doc);
     }
-    void write_font_info(FILE* fp)
+    void write_font_info(pdf_writer& doc, object_list& objects)
     {
-        m_obj_number->write(fp);
+        pdf_dictionary dict(objects.begin_object(m_obj_number, doc));
 
-        fprintf(fp, "<</Type /Font\n/Subtype /%s\n/BaseFont /%s\n", m_subtype.c_str(), m_basefont.c_str());
+        dict.name("/Type", "/Font").name("/Subtype", m_subtype).name("/BaseFont", m_basefont);
 
         if (!m_is_base_font)
         {
-            fprintf(fp, "/FirstChar %d\n", m_first_char);
+            dict.integer("/FirstChar", m_first_char);
 
-            fprintf(fp, "/LastChar %d\n", m_last_char);
+            dict.integer("/LastChar", m_last_char);
 
-            {
-                int n = 0;
-
-                fputs("/Widths [\n", fp);
-                for (int w : m_glyph_widths)
-                {
-                    fprintf(fp, "%d ", w);
-
-                    // only 20 per row
-                    if (++n == 20)
-                    {
-                        fputc('\n', fp);
-                        n = 0;
-                    }
-                }
-                fputs("]\n", fp);
-            }
+            // only 20 per row
+            dict.integers("/Widths", m_glyph_widths.data(), m_glyph_widths.size(), 20);
 
-            fprintf(fp, "/FontDescriptor %d 0 R\n", m_font_descriptor_number->m_number);
+            dict.ref("/FontDescriptor", m_font_descriptor_number->m_number);
         }
 
-        fputs(">>\nendobj\n", fp);
+        dict.end();
+
+        objects.end_object(doc);
     }
-    void write_type1_font(FILE* fp)
+    void write_type1_font(pdf_writer& out, const compression_profile& profile)
     {
         FILE* tfile = nullptr;
 
@@ -284,51 +244,57 @@ struct font_record
             // done with the file
             fclose(tfile);            
 
-            if (compressor.compress(dest_buffer, source, total_length, 9))
+            if (compressor.compress(dest_buffer, source, total_length, profile.m_font_level, profile))
             {
                 // change to the size of the compressed data
                 total_length = (long)dest_buffer.size();
 
                 // length3 is the text portion after the binary data; it's optional
-                fprintf(fp, "<</Filter /FlateDecode /Length %ld /Length1 %ld /Length2 %ld /Length3 0>>\nstream\n", total_length, length1, length2);
+                pdf_dictionary(out).name("/Filter", "/FlateDecode").integer("/Length", total_length)
+                    .integer("/Length1", length1).integer("/Length2", length2).integer("/Length3", 0);
+
+                out.put("stream\n");
 
-                fwrite(dest_buffer.data(), 1, total_length, fp);
+                out.write(dest_buffer.data(), total_length);
             }
             else
             {
-                fprintf(fp, "<<//Length %ld /Length1 %ld /Length2 %ld /Length3 0>>\nstream\n", total_length, length1, length2);
+                pdf_dictionary(out).integer("/Length", total_length).integer("/Length1", length1)
+                    .integer("/Length2", length2).integer("/Length3", 0);
+
+                out.put("stream\n");
 
                 // write the source data uncompressed
 
-                fwrite(source, 1, total_length, fp);
+                out.write(source, total_length);
             }
-            fputs("\nendstream\n", fp);
+            out.put("\nendstream\n");
         }
     }
-    void write_font_file(FILE *fp)
+    void write_font_file(pdf_writer& out, const compression_profile& profile)
     {
         //int length1 = 0, length2 = 0, length3 = 0;
 
-        m_font_file_number->write(fp);
+        m_font_file_number->write(out);
 
         if (m_subtype == "Type1")
         {
             //todo
-            write_type1_font(fp);
+            write_type1_font(out, profile);
         }
-        fputs("endobj\n", fp);
+        out.put("endobj\n");
     }
-    void write(FILE* fp)
+    void write(pdf_writer& out, object_list& objects, const compression_profile& profile)
     {
-        write_font_info(fp);
+        write_font_info(out, objects);
 
         if (m_font_descriptor_number)
         {
-            write_font_descriptor(fp);
+            write_font_descriptor(out, objects);
         }
         if (m_font_file_number)
         {
-            write_font_file(fp);
+            write_font_file(out, profile);
         }
     }
 };
@@ -652,7 +618,36 @@ public:
             return font;
         }
     }
-    void write_font(FILE *m_output_file)
+    // the font whose number() is 'number'
+    font_record* find_number(int32_t number)
+    {
+        for (auto it : m_table)
+        {
+            if (it.second && it.second->m_number == number)
+            {
+                return it.second;
+            }
+        }
+        return nullptr;
+    }
+    // forgets the objects of the fonts, for a new file; the fonts keep their numbers
+    void reset_objects()
+    {
+        for (auto it : m_table)
+        {
+            font_record* font = it.second;
+
+            if (font)
+            {
+                font->m_obj_number = nullptr;
+                font->m_font_descriptor_number = nullptr;
+                font->m_font_file_number = nullptr;
+
+                font->in_use(false);
+            }
+        }
+    }
+    void write_font(pdf_writer& out, object_list& objects, const compression_profile& profile)
     {
         // write the font object to the file
         for (auto it : m_table)
@@ -662,7 +657,7 @@ public:
             // write the font only if it was used
             if (font && font->m_font_in_use)
             {
-                font->write(m_output_file);
+                font->write(out, objects, profile);
             }
         }
     }
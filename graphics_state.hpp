@@ -55,6 +55,26 @@ struct solid_color
 		m_rgb.r = m_rgb.g = m_rgb.b = m_rgb.unused = 0;
 		m_type = color_type::rgb;
 	}
+	bool operator==(const solid_color& other) const
+	{
+		if (m_type != other.m_type)
+		{
+			return false;
+		}
+		switch (m_type)
+		{
+		case color_type::rgb:
+			return m_rgb.r == other.m_rgb.r && m_rgb.g == other.m_rgb.g && m_rgb.b == other.m_rgb.b;
+		case color_type::cmyk:
+			return m_cmyk.c == other.m_cmyk.c && m_cmyk.m == other.m_cmyk.m && m_cmyk.y == other.m_cmyk.y && m_cmyk.k == other.m_cmyk.k;
+		default:
+			return m_rgb.r == other.m_rgb.r;
+		}
+	}
+	bool operator!=(const solid_color& other) const
+	{
+		return !(*this == other);
+	}
 };
 
 struct dash_pattern
@@ -81,6 +101,14 @@ struct dash_pattern
 	{
 		return (0 == m_phase) && (m_array.size() == 0);
 	}
+	bool operator==(const dash_pattern& other) const
+	{
+		return m_phase == other.m_phase && m_array == other.m_array;
+	}
+	bool operator!=(const dash_pattern& other) const
+	{
+		return !(*this == other);
+	}
 	void set_value(std::vector<real_t>& _array, real_t phase)
 	{
 		m_array.clear();
@@ -92,13 +120,11 @@ struct dash_pattern
 		_array = m_array;
 		phase = m_phase;
 	}
-	friend std::ostream& operator<<(std::ostream& os, const dash_pattern& dash)
+	friend content_writer& operator<<(content_writer& os, const dash_pattern& dash)
 	{
 		size_t size = dash.m_array.size();
 		size_t i = 0;
 
-		os << std::fixed;
-
 		os << '[';
 
 		for (auto v : dash.m_array)
@@ -124,6 +150,27 @@ enum class clip_type
 	evenodd
 };
 
+// the parameters already set in the content stream of a page, so that a paint operation writes
+// only those that changed. The colors and the line width are unknown until first written; the
+// others start with their PDF defaults
+struct written_state
+{
+	solid_color m_stroke_color;
+	solid_color m_fill_color;
+	real_t m_linewidth{ 1.0f };
+	bool m_stroke_color_set{ false };
+	bool m_fill_color_set{ false };
+	bool m_linewidth_set{ false };
+	byte_t m_linejoin{ 0 };
+	byte_t m_linecap{ 0 };
+	dash_pattern m_dash_pattern;
+
+	void reset()
+	{
+		*this = written_state();
+	}
+};
+
 struct graphics_state
 {
 	solid_color m_stroke_color;
@@ -136,6 +183,7 @@ struct graphics_state
 	byte_t m_linejoin{ 0 };
 	byte_t m_linecap{ 0 };
 	font_record* m_font{ nullptr };
+	matrix m_font_matrix; // the font size; the font record itself is shared by all the pages
 
 	real_t m_flatness{ 0.0f };
 	matrix m_ctm;
@@ -144,9 +192,12 @@ struct graphics_state
 	real_t m_miterlimit{ 10.0f };
 	path_data m_clipping_path;
 	dash_pattern m_dash_pattern;
-	std::stack<path_data> m_clipping_path_stack;
+	std::stack<std::pair<path_data, uint64_t>> m_clipping_path_stack; // with their ids
 	clip_type m_clip_type{ clip_type::none };
-	graphics_state() : m_ctm(), m_stroke_color(), m_fill_color(), m_clipping_path(), m_dash_pattern(), m_clipping_path_stack()
+	// identifies the clip: each change of the clipping path or of its type gets a new id from the
+	// page, so the page can tell whether the clip in effect in its content is still the current one
+	uint64_t m_clip_id{ 0 };
+	graphics_state() : m_font_matrix(), m_ctm(), m_stroke_color(), m_fill_color(), m_clipping_path(), m_dash_pattern(), m_clipping_path_stack()
 	{}
 	void reset()
 	{
@@ -170,6 +221,7 @@ struct graphics_state
 		clear_clipping_path_stack();
 
 		m_clip_type = clip_type::none;
+		m_clip_id = 0;
 	}
 	void copy(const graphics_state& ci)
 	{
@@ -183,6 +235,7 @@ struct graphics_state
 		m_linejoin = ci.m_linejoin;
 		m_linecap = ci.m_linecap;
 		m_font = (font_record*)ci.m_font;
+		m_font_matrix = ci.m_font_matrix;
 		m_flatness = ci.m_flatness;
 		m_ctm = ci.m_ctm;
 		m_last_moveto = ci.m_last_moveto;
@@ -192,6 +245,7 @@ struct graphics_state
 		m_dash_pattern = ci.m_dash_pattern;
 		m_clipping_path_stack = ci.m_clipping_path_stack;
 		m_clip_type = ci.m_clip_type;
+		m_clip_id = ci.m_clip_id;
 	}
 	graphics_state(const graphics_state& ci)
 	{
@@ -214,7 +268,7 @@ struct graphics_state
 	{
 		try
 		{
-			m_clipping_path_stack.push(m_clipping_path);
+			m_clipping_path_stack.emplace(m_clipping_path, m_clip_id);
 
 			return true;
 		}
@@ -227,60 +281,102 @@ struct graphics_state
 	{
 		if (!m_clipping_path_stack.empty())
 		{
-			m_clipping_path = m_clipping_path_stack.top();
+			m_clipping_path = m_clipping_path_stack.top().first;
+			m_clip_id = m_clipping_path_stack.top().second;
 			m_clipping_path_stack.pop();
 		}
 	}
-	void write_clip(std::ostringstream& stream)
+	bool has_clip() const
 	{
-		if (m_clip_type != clip_type::none)
+		return m_clip_type != clip_type::none && m_clipping_path.size() != 0;
+	}
+	void write_clip(content_writer& stream)
+	{
+		if (has_clip())
 		{
 			std::string command = (m_clip_type == clip_type::nonzero) ? "W n" : "W* n";
 
 			m_clipping_path.write_clip(stream, command);
 		}
 	}
-	void on_stroke(std::ostringstream& str, const matrix &ctm)
+	// true if on_stroke() would write nothing: the stroke parameters in 'written' are the current ones
+	bool stroke_written(const matrix& ctm, const written_state& written) const
 	{
-		real_t scale = (ctm.sx + ctm.sy)/2.0f;
+		real_t scale = (ctm.sx + ctm.sy) / 2.0f;
 
-			
+		return m_linejoin == written.m_linejoin && m_linecap == written.m_linecap && m_dash_pattern == written.m_dash_pattern
+			&& written.m_stroke_color_set && m_stroke_color == written.m_stroke_color
+			&& written.m_linewidth_set && written.m_linewidth == m_linewidth * scale;
+	}
+	// true if on_fill() would write nothing
+	bool fill_written(const written_state& written) const
+	{
+		return written.m_fill_color_set && m_fill_color == written.m_fill_color;
+	}
+	// writes the stroke parameters that differ from those in 'written', and updates it
+	void on_stroke(content_writer& str, const matrix &ctm, written_state& written)
+	{
+		real_t scale = (ctm.sx + ctm.sy)/2.0f;
 
 		// linecap J
 		// linejoin j
 		// flatness i
 
-			if (m_linejoin != 0)
+			if (m_linejoin != written.m_linejoin)
 			{
 				str << (short)m_linejoin << " j\n";
+
+				written.m_linejoin = m_linejoin;
 			}
-			if (m_linecap != 0)
+			if (m_linecap != written.m_linecap)
 			{
 				str << (short)m_linecap << " J\n";
+
+				written.m_linecap = m_linecap;
 			}
-			if (!m_dash_pattern.is_default())
+			if (m_dash_pattern != written.m_dash_pattern)
 			{
 				str << m_dash_pattern << " d\n";
+
+				written.m_dash_pattern = m_dash_pattern;
 			}
-			switch (m_stroke_color.m_type)
+			if (!written.m_stroke_color_set || m_stroke_color != written.m_stroke_color)
 			{
-			case color_type::rgb:
-				str << m_stroke_color.m_rgb.r << ' ' << m_stroke_color.m_rgb.g << ' ' << m_stroke_color.m_rgb.b << " RG\n";
-				break;
-			case color_type::cmyk:
-				str << m_stroke_color.m_cmyk.c << ' ' << m_stroke_color.m_cmyk.m << ' ' << m_stroke_color.m_cmyk.y << ' ' << m_stroke_color.m_cmyk.k << " K\n";
-				break;
-			default:
-				str << m_stroke_color.m_rgb.r << " G\n";
-				break;
+				switch (m_stroke_color.m_type)
+				{
+				case color_type::rgb:
+					str << m_stroke_color.m_rgb.r << ' ' << m_stroke_color.m_rgb.g << ' ' << m_stroke_color.m_rgb.b << " RG\n";
+					break;
+				case color_type::cmyk:
+					str << m_stroke_color.m_cmyk.c << ' ' << m_stroke_color.m_cmyk.m << ' ' << m_stroke_color.m_cmyk.y << ' ' << m_stroke_color.m_cmyk.k << " K\n";
+					break;
+				default:
+					str << m_stroke_color.m_rgb.r << " G\n";
+					break;
+				}
+
+				written.m_stroke_color = m_stroke_color;
+				written.m_stroke_color_set = true;
 			}
-			
-			str << (m_linewidth * scale) << " w\n";
 
-	}
+			if (!written.m_linewidth_set || written.m_linewidth != m_linewidth * scale)
+			{
+				str << (m_linewidth * scale) << " w\n";
 
-	void on_fill(std::ostringstream& str)
+				written.m_linewidth = m_linewidth * scale;
+				written.m_linewidth_set = true;
+			}
+	}
+	// writes the fill color if it differs from the one in 'written', and updates it
+	void on_fill(content_writer& str, written_state& written)
 	{
+			if (written.m_fill_color_set && m_fill_color == written.m_fill_color)
+			{
+				return;
+			}
+
+			written.m_fill_color = m_fill_color;
+			written.m_fill_color_set = true;
 
 			switch (m_fill_color.m_type)
 			{
@@ -303,6 +399,18 @@ struct graphics_state
 	{
 		m_font = fnt;
 	}
+	const matrix& font_matrix() const
+	{
+		return m_font_matrix;
+	}
+	real_t font_size() const
+	{
+		return m_font_matrix.sy;
+	}
+	void scalefont(real_t size)
+	{
+		m_font_matrix.sx = m_font_matrix.sy = size;
+	}
 	void linewidth(real_t value)
 	{
 		m_linewidth = value;
@@ -13,51 +13,187 @@
 #pragma once
 #include "types.h"
 #include "compressor.hpp"
+#include "pdf_writer.hpp"
 
 class image_manager
 {
-	std::map<std::string, int32_t> m_table;
+	struct image_entry
+	{
+		int32_t m_name{ 0 }; // given when the image is loaded, e.g., 3 for /Im3
+		int32_t m_object{ 0 }; // in the file being written; 0 if not written there yet
+		// the object as it's written, from its dictionary to endobj, until it's written; an image
+		// used again in another part of a split document is encoded again
+		byte_vector m_body;
+	};
+	std::map<std::string, image_entry> m_table;
+	std::map<int32_t, std::string> m_filenames; // by name
+	int32_t m_last_name{ 0 };
 private:
-	void copy_image(byte_vector& dest_buffer, unsigned width, unsigned height, unsigned stride, Gdiplus::PixelFormat format, const byte_t* source_data)
+	// the PNG filters, which predict a byte from the same component of the pixel to the left,
+	// of the pixel above and of the one above to the left; the first pixel of a row has none to
+	// the left, and the first row none above
+	enum png_filter : byte_t { png_none, png_sub, png_up, png_average, png_paeth, png_filter_count };
+
+	static const unsigned bytes_per_pixel = 3;
+
+	// converts a row from BGR to RGB
+	static void convert_row(byte_t* dest, const byte_t* src, unsigned row_width)
 	{
-		byte_vector tmp;
-		stream_compressor compressor;
-		unsigned row_width;
-		byte_t* src, * dest;
+		for (unsigned j = 0; j < row_width; j += 3)
+		{
+			dest[j] = src[j + 2];
+			dest[j + 1] = src[j + 1];
+			dest[j + 2] = src[j];
+		}
+	}
+	// the differences between a row and its prediction. Whole rows go through loops without
+	// branches, so that the compiler vectorizes them
+	static void filter_row(png_filter filter, byte_t* out, const byte_t* row, const byte_t* prior, unsigned row_width)
+	{
+		const unsigned bpp = bytes_per_pixel;
 
+		switch (filter)
+		{
+		case png_none:
+			memcpy(out, row, row_width);
+			break;
+		case png_sub:
+			memcpy(out, row, bpp);
+
+			for (unsigned i = bpp; i < row_width; ++i)
+			{
+				out[i] = (byte_t)(row[i] - row[i - bpp]);
+			}
+			break;
+		case png_up:
+			for (unsigned i = 0; i < row_width; ++i)
+			{
+				out[i] = (byte_t)(row[i] - prior[i]);
+			}
+			break;
+		case png_average:
+			for (unsigned i = 0; i < bpp; ++i)
+			{
+				out[i] = (byte_t)(row[i] - (prior[i] >> 1));
+			}
+			for (unsigned i = bpp; i < row_width; ++i)
+			{
+				out[i] = (byte_t)(row[i] - ((row[i - bpp] + prior[i]) >> 1));
+			}
+			break;
+		default:
+			// Paeth: the neighbour closest to left + above - upper left
+			for (unsigned i = 0; i < bpp; ++i)
+			{
+				out[i] = (byte_t)(row[i] - prior[i]);
+			}
+			for (unsigned i = bpp; i < row_width; ++i)
+			{
+				int a = row[i - bpp], b = prior[i], c = prior[i - bpp];
+				int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+				int predicted = (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
 
-		src = (byte_t*)source_data;
+				out[i] = (byte_t)(row[i] - predicted);
+			}
+			break;
+		}
+	}
+	// how well a filter predicted a row: the smaller the sum of its output as signed bytes, the
+	// better it compresses, as libpng estimates
+	static unsigned filter_cost(const byte_t* out, unsigned row_width)
+	{
+		unsigned sum = 0;
 
-		row_width = width * 3;
+		for (unsigned i = 0; i < row_width; ++i)
+		{
+			sum += (unsigned)abs((int8_t)out[i]);
+		}
+		return sum;
+	}
+	// the rows of the image as RGB, each one preceded by the byte of the filter that predicts it
+	// best; see /DecodeParms in write_image_data()
+	static void predict_rows(byte_vector& dest_buffer, unsigned width, unsigned height, unsigned stride, const byte_t* source_data)
+	{
+		unsigned row_width = width * bytes_per_pixel;
+		byte_vector rows, candidate;
+		byte_t* row, * prior, * dest;
 
-		tmp.resize(row_width * height);
+		try
+		{
+			// the current row and the one above, initially 0
+			rows.resize(row_width * 2);
+			candidate.resize(row_width);
+			dest_buffer.resize((size_t)(row_width + 1) * height);
+		}
+		catch (...)
+		{
+			throw std::runtime_error("Out of memory");
+		}
 
-		dest = tmp.data();
+		row = rows.data();
+		prior = rows.data() + row_width;
+		dest = dest_buffer.data();
 
 		for (unsigned i = 0; i < height; ++i)
 		{
-			// convert from bgr to rgb
-			for (unsigned j = 0; j < row_width; j += 3)
+			unsigned best_cost = UINT_MAX;
+
+			convert_row(row, source_data + (size_t)i * stride, row_width);
+
+			for (byte_t f = png_none; f < png_filter_count; ++f)
 			{
-				const byte_t* p = src + j;
+				unsigned cost;
 
-				dest[0] = p[2];
-				dest[1] = p[1];
-				dest[2] = p[0];
-				dest += 3;
+				filter_row((png_filter)f, candidate.data(), row, prior, row_width);
+
+				cost = filter_cost(candidate.data(), row_width);
+
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+
+					dest[0] = f;
+
+					memcpy(dest + 1, candidate.data(), row_width);
+				}
 			}
 
-			src += stride;
+			dest += row_width + 1;
+
+			std::swap(row, prior);
+		}
+	}
+	// returns true if the image data was compressed; the rows are then predicted by PNG filters
+	bool copy_image(byte_vector& dest_buffer, unsigned width, unsigned height, unsigned stride, Gdiplus::PixelFormat format, const byte_t* source_data, const compression_profile& profile)
+	{
+		byte_vector tmp;
+		stream_compressor compressor;
+		unsigned row_width = width * bytes_per_pixel;
+
+		if (profile.m_image_level != 0)
+		{
+			predict_rows(tmp, width, height, stride, source_data);
+
+			if (compressor.compress(dest_buffer, tmp.data(), tmp.size(), profile.m_image_level, profile))
+			{
+				return true;
+			}
 		}
 
-		if (!compressor.compress(dest_buffer, tmp.data(), tmp.size(), 9))
+		// copy as-is if compression failed or was skipped
+		tmp.resize((size_t)row_width * height);
+
+		for (unsigned i = 0; i < height; ++i)
 		{
-			// copy as-is if compression failed
-			dest_buffer = tmp;
+			convert_row(tmp.data() + (size_t)i * row_width, source_data + (size_t)i * stride, row_width);
 		}
+
+		dest_buffer.swap(tmp);
+
+		return false;
 	}
 public:
-	image_manager() : m_table()
+	image_manager() : m_table(), m_filenames()
 	{
 	}
 	~image_manager()
@@ -67,19 +203,83 @@ public:
 	void clear()
 	{
 		m_table.clear();
+		m_filenames.clear();
 	}
-	int32_t find_image(const char* filename)
+	// the name of the image; it's loaded and encoded the first time, but not written. Returns
+	// NOTFOUND if it can't be loaded
+	int32_t find_image(const char* filename, const compression_profile& profile)
 	{
 		auto it = m_table.find(std::string(filename));
+		image_entry entry;
 
-		if (it == m_table.end())
+		if (it != m_table.end())
+		{
+			return it->second.m_name;
+		}
+		else if (!encode_image(filename, entry.m_body, profile))
 		{
 			return NOTFOUND;
 		}
 
-		return it->second;
+		entry.m_name = ++m_last_name;
+
+		try
+		{
+			m_filenames[entry.m_name] = filename;
+			m_table[std::string(filename)] = std::move(entry);
+		}
+		catch (...)
+		{
+			throw std::runtime_error("Out of memory");
+		}
+
+		return m_last_name;
+	}
+	// the object of the image in the file being written; 0 if it must be written there
+	int32_t image_object(int32_t name) const
+	{
+		auto it = m_filenames.find(name);
+
+		return (it != m_filenames.end()) ? m_table.at(it->second).m_object : 0;
+	}
+	// the size of the image object not counting its first line, "n 0 obj"; 0 if it's written in
+	// the file already or can't be encoded. An image is encoded again here for a new file
+	size_t object_size(int32_t name, const compression_profile& profile)
+	{
+		auto it = m_filenames.find(name);
+		image_entry* entry = (it != m_filenames.end()) ? &m_table.at(it->second) : nullptr;
+
+		if (!entry || entry->m_object != 0)
+		{
+			return 0;
+		}
+		else if (entry->m_body.empty() && !encode_image(it->second.c_str(), entry->m_body, profile))
+		{
+			return 0;
+		}
+		return entry->m_body.size();
+	}
+	// writes the image as object 'object_number'; object_size() must have returned its size
+	void write_image(int32_t name, int32_t object_number, pdf_writer& out)
+	{
+		image_entry& entry = m_table.at(m_filenames.at(name));
+
+		out.write(entry.m_body.data(), entry.m_body.size());
+
+		entry.m_object = object_number;
+
+		byte_vector().swap(entry.m_body);
+	}
+	// forgets the objects of the images, for a new file; the images keep their names
+	void reset_objects()
+	{
+		for (auto& it : m_table)
+		{
+			it.second.m_object = 0;
+		}
 	}
-	bool add_image(const char* filename, int32_t object_number, FILE *fp)
+	// the dictionary and the stream of the image object
+	bool encode_image(const char* filename, byte_vector& body, const compression_profile& profile)
 	{
 		size_t len = strlen(filename);
 		std::vector<wchar_t> wfilename(len*2+1, 0);
@@ -99,7 +299,7 @@ public:
 			}
 			else
 			{
-				bool result = true;
+				bool result = true, compressed;
 
 				Gdiplus::BitmapData data;
 				Gdiplus::PixelFormat format;
@@ -107,6 +307,8 @@ public:
 				Gdiplus::Rect rect;
 				byte_vector dest_buffer;
 				short bits_per_component;
+				memory_sink sink;
+				pdf_writer out;
 
 				format = bmp->GetPixelFormat();			
 				width = bmp->GetWidth();
@@ -122,34 +324,51 @@ public:
 
 				bits_per_component = 8;
 
-				copy_image(dest_buffer, width, height, stride, PixelFormat24bppRGB, (byte_t*)data.Scan0);
-
-				result = write_image_data(dest_buffer, fp, width, height, bits_per_component);
+				compressed = copy_image(dest_buffer, width, height, stride, PixelFormat24bppRGB, (byte_t*)data.Scan0, profile);
 
 				bmp->UnlockBits(&data);
 
 				delete bmp;
 
+				out.attach(sink);
+
+				result = write_image_data(dest_buffer, compressed, out, width, height, bits_per_component) && out.flush();
+
 				if (result)
 				{
-					m_table[std::string(filename)] = object_number;
+					body = sink.release();
 				}
 				return result;
 			}
 		}
 	}	
 	
-	bool write_image_data(byte_vector dest_buffer, FILE* fp, unsigned width, unsigned height, short bits_per_component)
+	bool write_image_data(const byte_vector& dest_buffer, bool compressed, pdf_writer& out, unsigned width, unsigned height, short bits_per_component)
 	{
-		unsigned length = (unsigned)dest_buffer.size();
+		size_t length = dest_buffer.size();
+
+		{
+			pdf_dictionary dict(out);
+
+			dict.name("/Type", "/XObject").name("/Subtype", "/Image").integer("/Width", width).integer("/Height", height)
+				.name("/ColorSpace", "/DeviceRGB").integer("/BitsPerComponent", bits_per_component);
+
+			if (compressed)
+			{
+				dict.name("/Filter", "/FlateDecode");
+
+				pdf_dictionary(dict.value("/DecodeParms")).integer("/Predictor", 15).integer("/Colors", bytes_per_pixel)
+					.integer("/BitsPerComponent", bits_per_component).integer("/Columns", width);
+			}
+
+			dict.integer("/Length", (int64_t)length);
+		}
 
-		std::fprintf(fp, "<</Type /XObject\n/Subtype /Image\n/Width %u\n/Height %u\n", width, height);
-			
-		std::fprintf(fp, "/ColorSpace /DeviceRGB\n/BitsPerComponent %d\n/Filter /FlateDecode\n/Length %u\n>>\nstream\n", bits_per_component, length);
+		out.put("stream\n");
 
-		std::fwrite(dest_buffer.data(), 1, length, fp);
+		out.write(dest_buffer.data(), length);
 
-		std::fputs("\nendstream\nendobj\n", fp);
+		out.put("\nendstream\nendobj\n");
 
 		return true;
 	}
@@ -0,0 +1,887 @@
+/*
+//  Copyright (c) 2020 Peter Frane Jr. All Rights Reserved.
+//
+//  Use of this source code is governed by the BSD 3-Clause License that can be
+//  found in the LICENSE file.
+//
+//  This software is distributed on an "AS IS" basis, WITHOUT WARRANTY
+//  OF ANY KIND, either express or implied.
+//
+//  For inquiries, email the author at pfranejr AT hotmail.com
+*/
+
+#pragma once
+#include "types.h"
+#include "pdf_writer.hpp"
+#include "pdf_reader.hpp"
+
+// rewrites a document written by this library as a linearized ("fast web view") file.
+// The layout follows Annex F of the PDF reference:
+//   header, linearization dictionary, first-page xref section, catalog, hint stream,
+//   first page and everything it uses, the other pages with their own objects,
+//   the objects shared by several pages, the page tree, main xref section.
+// The objects are renumbered so that the first-page section holds the highest numbers;
+// the references in the dictionaries are renumbered too, the streams are copied as they are
+class linearizer
+{
+    static const size_t read_size = 4096;
+    static const int field_width = 10; // of the values filled in once the layout is known
+
+    static const int32_t no_page = -1;
+    static const int32_t shared_object = -2;
+    static const int32_t placed = -2; // m_mark of the objects already in a section
+
+    enum class object_kind
+    {
+        free,
+        other,
+        pages, // a node of the page tree
+        page
+    };
+
+    struct object_info
+    {
+        object_kind m_kind{ object_kind::free };
+        int64_t m_offset{ 0 }; // in the source
+        int64_t m_length{ 0 }; // in the source
+        int64_t m_tail{ 0 }; // the bytes after the dictionary, relative to m_offset; they are copied as they are
+        std::string m_dict; // empty if the object isn't a dictionary
+        int32_t m_number{ 0 }; // the new object number
+        int32_t m_page{ no_page }; // the only page using the object, or shared_object
+        int32_t m_mark{ -1 }; // the last page whose objects were collected, or placed
+        int64_t m_size{ 0 }; // in the new file
+        int64_t m_new_offset{ 0 }; // in the new file, not counting the hint stream
+    };
+
+    // writes the bit fields of the hint tables, most significant bit first
+    class bit_writer
+    {
+        byte_vector& m_data;
+        uint32_t m_byte{ 0 };
+        int m_bits{ 0 };
+    public:
+        explicit bit_writer(byte_vector& data) : m_data(data)
+        {
+        }
+        void put(uint64_t value, int bits)
+        {
+            for (int i = bits - 1; i >= 0; --i)
+            {
+                m_byte = (m_byte << 1) | (uint32_t)((value >> i) & 1);
+
+                if (8 == ++m_bits)
+                {
+                    m_data.push_back((byte_t)m_byte);
+
+                    m_byte = 0;
+                    m_bits = 0;
+                }
+            }
+        }
+        // pads the last byte with zeros
+        void align()
+        {
+            if (m_bits != 0)
+            {
+                put(0, 8 - m_bits);
+            }
+        }
+    };
+
+    FILE* m_source{ nullptr };
+    std::vector<object_info> m_objects; // indexed by the old object number
+    int32_t m_catalog{ 0 };
+    int32_t m_lin_dict{ 0 }; // the new numbers of the objects that the rewrite adds
+    int32_t m_hint_stream{ 0 };
+    int32_t m_main_count{ 0 }; // the objects listed in the main xref section
+    int_vector m_pages; // in page order
+    std::vector<int_vector> m_page_objects; // of each page: the page, then all the objects it uses
+    int_vector m_first_section; // the first page and the objects it uses
+    int_vector m_shared_first; // the shared objects of the first-page section
+    int_vector m_other_pages; // the other pages, each followed by its own objects
+    int_vector m_shared; // the shared objects not used by the first page
+    int_vector m_rest; // the page tree and the unreferenced objects
+    int64_t m_header_size{ 0 };
+private:
+    bool seek(int64_t offset)
+    {
+#ifdef _WIN32
+        return 0 == _fseeki64(m_source, offset, SEEK_SET);
+#else
+        return 0 == fseeko(m_source, (off_t)offset, SEEK_SET);
+#endif
+    }
+    bool read_at(int64_t offset, size_t size, std::string& data)
+    {
+        data.resize(size);
+
+        if (!seek(offset))
+        {
+            return false;
+        }
+
+        return std::fread(&data[0], 1, size, m_source) == size;
+    }
+    // the position after the dictionary starting at 'pos'; 0 if it isn't complete
+    static size_t dictionary_end(const std::string& str, size_t pos)
+    {
+        int depth = 0;
+
+        while (pos < str.size())
+        {
+            if (str.compare(pos, 2, "<<") == 0)
+            {
+                ++depth;
+                pos += 2;
+            }
+            else if (str.compare(pos, 2, ">>") == 0)
+            {
+                pos += 2;
+
+                if (0 == --depth)
+                {
+                    return pos;
+                }
+            }
+            else if ('(' == str[pos])
+            {
+                int nesting = 0;
+
+                for (; pos < str.size(); ++pos)
+                {
+                    if ('\\' == str[pos])
+                    {
+                        ++pos;
+                    }
+                    else if ('(' == str[pos])
+                    {
+                        ++nesting;
+                    }
+                    else if (')' == str[pos] && 0 == --nesting)
+                    {
+                        break;
+                    }
+                }
+                ++pos;
+            }
+            else
+            {
+                ++pos;
+            }
+        }
+        return 0;
+    }
+    static size_t skip_space(const std::string& str, size_t pos)
+    {
+        while (pos < str.size() && isspace((byte_t)str[pos]))
+        {
+            ++pos;
+        }
+        return pos;
+    }
+    object_info* get_object(int32_t number)
+    {
+        if (number > 0 && (size_t)number < m_objects.size() && m_objects[number].m_kind != object_kind::free)
+        {
+            return &m_objects[number];
+        }
+        return nullptr;
+    }
+    // reads the dictionaries of all the objects; the streams stay in the source
+    bool load_objects(const std::vector<int64_t>& offsets, int64_t end)
+    {
+        std::vector<std::pair<int64_t, int32_t>> order; // offset, number
+        std::string data;
+
+        m_objects.resize(offsets.size());
+
+        for (size_t i = 1; i < offsets.size(); ++i)
+        {
+            if (offsets[i] > 0 && offsets[i] < end)
+            {
+                order.emplace_back(offsets[i], (int32_t)i);
+            }
+        }
+
+        if (order.empty())
+        {
+            return false;
+        }
+
+        std::sort(order.begin(), order.end());
+
+        m_header_size = order.front().first;
+
+        for (size_t i = 0; i < order.size(); ++i)
+        {
+            object_info& obj = m_objects[order[i].second];
+            size_t size = read_size;
+            size_t pos, dict_end = 0;
+
+            obj.m_kind = object_kind::other;
+            obj.m_offset = order[i].first;
+            obj.m_length = ((i + 1 < order.size()) ? order[i + 1].first : end) - obj.m_offset;
+
+            // the dictionary follows "n 0 obj"; it may be longer than the first block, e.g., the /Widths of a font
+            for (;;)
+            {
+                size = (size_t)(std::min)((int64_t)size, obj.m_length);
+
+                if (!read_at(obj.m_offset, size, data))
+                {
+                    return false;
+                }
+
+                pos = data.find("obj");
+
+                if (std::string::npos == pos)
+                {
+                    return false;
+                }
+
+                pos = skip_space(data, pos + 3);
+
+                if (data.compare(pos, 2, "<<") != 0)
+                {
+                    break;
+                }
+
+                dict_end = dictionary_end(data, pos);
+
+                if (dict_end != 0 || (int64_t)size == obj.m_length)
+                {
+                    break;
+                }
+
+                size *= 2;
+            }
+
+            if (dict_end != 0)
+            {
+                obj.m_dict.assign(data, pos, dict_end - pos);
+                obj.m_tail = (int64_t)dict_end;
+            }
+            else
+            {
+                obj.m_tail = (int64_t)pos;
+            }
+        }
+        return true;
+    }
+    // lists the pages in order, starting at the root of the page tree; the resources of the
+    // nodes apply to all the pages below them
+    void walk_tree(int32_t number, const int_vector& inherited, std::vector<int_vector>& page_refs)
+    {
+        object_info* node = get_object(number);
+        int_vector refs(inherited), kids;
+
+        if (!node || node->m_kind != object_kind::other)
+        {
+            // missing, or already seen
+            return;
+        }
+
+        pdf_reader::scan_refs(node->m_dict, [&](const std::string& key, int32_t ref)
+            {
+                if ("/Kids" == key)
+                {
+                    kids.push_back(ref);
+                }
+                else if (key != "/Parent")
+                {
+                    refs.push_back(ref);
+                }
+                return ref;
+            }, nullptr);
+
+        if (node->m_dict.find("/Kids") == std::string::npos)
+        {
+            node->m_kind = object_kind::page;
+
+            m_pages.push_back(number);
+
+            page_refs.push_back(std::move(refs));
+        }
+        else
+        {
+            node->m_kind = object_kind::pages;
+
+            for (int32_t kid : kids)
+            {
+                walk_tree(kid, refs, page_refs);
+            }
+        }
+    }
+    // finds the objects used by each page and sorts them into the sections of the file
+    bool sort_objects()
+    {
+        std::vector<int_vector> page_refs;
+        int32_t root = 0;
+
+        {
+            object_info* catalog = get_object(m_catalog);
+
+            if (!catalog)
+            {
+                return false;
+            }
+
+            pdf_reader::scan_refs(catalog->m_dict, [&](const std::string& key, int32_t ref)
+                {
+                    if ("/Pages" == key)
+                    {
+                        root = ref;
+                    }
+                    return ref;
+                }, nullptr);
+        }
+
+        walk_tree(root, int_vector(), page_refs);
+
+        if (m_pages.empty())
+        {
+            return false;
+        }
+
+        m_page_objects.resize(m_pages.size());
+
+        for (size_t page = 0; page < m_pages.size(); ++page)
+        {
+            int_vector& list = m_page_objects[page];
+            int_vector stack(page_refs[page].rbegin(), page_refs[page].rend());
+
+            list.push_back(m_pages[page]);
+
+            while (!stack.empty())
+            {
+                object_info* obj = get_object(stack.back());
+                int32_t number = stack.back();
+
+                stack.pop_back();
+
+                if (!obj || obj->m_kind != object_kind::other || (int32_t)page == obj->m_mark)
+                {
+                    continue;
+                }
+
+                obj->m_mark = (int32_t)page;
+
+                if (no_page == obj->m_page)
+                {
+                    obj->m_page = (int32_t)page;
+                }
+                else if (obj->m_page != (int32_t)page)
+                {
+                    obj->m_page = shared_object;
+                }
+
+                list.push_back(number);
+
+                {
+                    size_t count = stack.size();
+
+                    pdf_reader::scan_refs(obj->m_dict, [&](const std::string&, int32_t ref)
+                        {
+                            stack.push_back(ref);
+                            return ref;
+                        }, nullptr);
+
+                    // keep the order of the dictionary
+                    std::reverse(stack.begin() + count, stack.end());
+                }
+            }
+        }
+
+        // the first page section holds everything the first page uses
+        m_first_section = m_page_objects[0];
+
+        for (int32_t number : m_first_section)
+        {
+            if (shared_object == m_objects[number].m_page)
+            {
+                m_shared_first.push_back(number);
+            }
+            m_objects[number].m_mark = placed;
+        }
+
+        for (size_t page = 1; page < m_pages.size(); ++page)
+        {
+            m_other_pages.push_back(m_pages[page]);
+
+            for (int32_t number : m_page_objects[page])
+            {
+                if ((int32_t)page == m_objects[number].m_page)
+                {
+                    m_other_pages.push_back(number);
+                }
+            }
+        }
+
+        for (size_t page = 1; page < m_pages.size(); ++page)
+        {
+            for (int32_t number : m_page_objects[page])
+            {
+                object_info& obj = m_objects[number];
+
+                if (shared_object == obj.m_page && obj.m_mark != placed)
+                {
+                    m_shared.push_back(number);
+
+                    obj.m_mark = placed;
+                }
+            }
+        }
+
+        for (size_t i = 1; i < m_objects.size(); ++i)
+        {
+            object_info& obj = m_objects[i];
+
+            if ((int32_t)i != m_catalog && obj.m_kind != object_kind::free && obj.m_kind != object_kind::page
+                && (obj.m_kind == object_kind::pages || no_page == obj.m_page))
+            {
+                m_rest.push_back((int32_t)i);
+            }
+        }
+        return true;
+    }
+    // the objects of the main xref section are numbered from 1 in file order; the first-page
+    // section follows them
+    void renumber()
+    {
+        int32_t number = 0;
+
+        for (const int_vector* list : { &m_other_pages, &m_shared, &m_rest })
+        {
+            for (int32_t i : *list)
+            {
+                m_objects[i].m_number = ++number;
+            }
+        }
+
+        m_main_count = number;
+
+        m_lin_dict = ++number;
+        m_objects[m_catalog].m_number = ++number;
+        m_hint_stream = ++number;
+
+        for (int32_t i : m_first_section)
+        {
+            m_objects[i].m_number = ++number;
+        }
+
+        for (object_info& obj : m_objects)
+        {
+            if (obj.m_kind != object_kind::free)
+            {
+                std::string dict;
+
+                pdf_reader::scan_refs(obj.m_dict, [&](const std::string&, int32_t ref)
+                    {
+                        object_info* target = get_object(ref);
+
+                        return target ? target->m_number : ref;
+                    }, &dict);
+
+                obj.m_dict.swap(dict);
+
+                obj.m_size = (int64_t)std::to_string(obj.m_number).size() + 7 + (int64_t)obj.m_dict.size() + obj.m_length - obj.m_tail;
+            }
+        }
+    }
+    int64_t place(const int_vector& list, int64_t offset)
+    {
+        for (int32_t i : list)
+        {
+            m_objects[i].m_new_offset = offset;
+
+            offset += m_objects[i].m_size;
+        }
+        return offset;
+    }
+    static int bits_needed(uint64_t value)
+    {
+        int bits = 0;
+
+        while (value != 0)
+        {
+            ++bits;
+            value >>= 1;
+        }
+        return bits;
+    }
+    // the page offset hint table and the shared object hint table; all the locations are given as if
+    // the hint stream were not in the file. Returns the offset of the shared object table
+    size_t write_hint_tables(byte_vector& data, int64_t first_section_end, int64_t other_pages_end)
+    {
+        size_t page_count = m_pages.size();
+        std::vector<int64_t> object_count(page_count), page_length(page_count);
+        std::vector<int_vector> shared_refs(page_count);
+        std::map<int32_t, int32_t> shared_id; // old object number to shared object identifier
+        int_vector all_shared(m_shared_first);
+        size_t shared_table;
+
+        all_shared.insert(all_shared.end(), m_shared.begin(), m_shared.end());
+
+        for (size_t i = 0; i < all_shared.size(); ++i)
+        {
+            shared_id[all_shared[i]] = (int32_t)i;
+        }
+
+        for (size_t page = 0; page < page_count; ++page)
+        {
+            if (0 == page)
+            {
+                object_count[page] = (int64_t)m_first_section.size();
+                page_length[page] = first_section_end - m_objects[m_pages[0]].m_new_offset;
+            }
+            else
+            {
+                int64_t end = (page + 1 < page_count) ? m_objects[m_pages[page + 1]].m_new_offset : other_pages_end;
+
+                object_count[page] = 1;
+                page_length[page] = end - m_objects[m_pages[page]].m_new_offset;
+            }
+
+            for (int32_t number : m_page_objects[page])
+            {
+                if (shared_object == m_objects[number].m_page)
+                {
+                    shared_refs[page].push_back(shared_id[number]);
+                }
+                else if (page != 0 && number != m_pages[page])
+                {
+                    ++object_count[page];
+                }
+            }
+        }
+
+        {
+            bit_writer bits(data);
+            int64_t least_count = *std::min_element(object_count.begin(), object_count.end());
+            int64_t least_length = *std::min_element(page_length.begin(), page_length.end());
+            int count_bits = bits_needed(*std::max_element(object_count.begin(), object_count.end()) - least_count);
+            int length_bits = bits_needed(*std::max_element(page_length.begin(), page_length.end()) - least_length);
+            size_t most_refs = 0;
+            int id_bits = all_shared.empty() ? 0 : bits_needed(all_shared.size() - 1);
+            int ref_bits;
+
+            for (const int_vector& refs : shared_refs)
+            {
+                most_refs = (std::max)(most_refs, refs.size());
+            }
+
+            ref_bits = bits_needed(most_refs);
+
+            bits.put(least_count, 32);
+            bits.put(m_objects[m_pages[0]].m_new_offset, 32);
+            bits.put(count_bits, 16);
+            bits.put(least_length, 32);
+            bits.put(length_bits, 16);
+            // the content stream items are not used; their fields take no bits
+            bits.put(0, 32);
+            bits.put(0, 16);
+            bits.put(0, 32);
+            bits.put(0, 16);
+            bits.put(ref_bits, 16);
+            bits.put(id_bits, 16);
+            bits.put(0, 16); // no fractional positions
+            bits.put(1, 16);
+
+            for (int64_t count : object_count)
+            {
+                bits.put(count - least_count, count_bits);
+            }
+            bits.align();
+
+            for (int64_t length : page_length)
+            {
+                bits.put(length - least_length, length_bits);
+            }
+            bits.align();
+
+            for (const int_vector& refs : shared_refs)
+            {
+                bits.put(refs.size(), ref_bits);
+            }
+            bits.align();
+
+            for (const int_vector& refs : shared_refs)
+            {
+                for (int32_t id : refs)
+                {
+                    bits.put(id, id_bits);
+                }
+            }
+            bits.align();
+        }
+
+        shared_table = data.size();
+
+        {
+            bit_writer bits(data);
+            int64_t least_length = 0, most_length = 0;
+            int length_bits;
+
+            for (size_t i = 0; i < all_shared.size(); ++i)
+            {
+                int64_t size = m_objects[all_shared[i]].m_size;
+
+                least_length = (0 == i) ? size : (std::min)(least_length, size);
+                most_length = (std::max)(most_length, size);
+            }
+
+            length_bits = bits_needed(most_length - least_length);
+
+            if (m_shared.empty())
+            {
+                bits.put(0, 32);
+                bits.put(0, 32);
+            }
+            else
+            {
+                bits.put(m_objects[m_shared[0]].m_number, 32);
+                bits.put(m_objects[m_shared[0]].m_new_offset, 32);
+            }
+            bits.put(m_shared_first.size(), 32);
+            bits.put(all_shared.size(), 32);
+            bits.put(0, 16); // each group is a single object
+            bits.put(least_length, 32);
+            bits.put(length_bits, 16);
+
+            for (int32_t number : all_shared)
+            {
+                bits.put(m_objects[number].m_size - least_length, length_bits);
+            }
+            bits.align();
+
+            // no signatures
+            for (size_t i = 0; i < all_shared.size(); ++i)
+            {
+                bits.put(0, 1);
+            }
+            bits.align();
+        }
+
+        return shared_table;
+    }
+    // a number in a field of 'field_width' characters, padded with spaces; the fields are
+    // filled in once the layout is known, without changing it
+    static std::string field(int64_t value)
+    {
+        std::string str = std::to_string(value);
+
+        str.resize((std::max)(str.size(), (size_t)field_width), ' ');
+
+        return str;
+    }
+    std::string linearization_dict(int64_t length, int64_t hint_offset, int64_t hint_size, int64_t first_page_end, int64_t main_xref_entries) const
+    {
+        return std::to_string(m_lin_dict) + " 0 obj\n<</Linearized 1 /L " + field(length)
+            + " /H [" + field(hint_offset) + ' ' + field(hint_size) + "] /O " + std::to_string(m_objects[m_pages[0]].m_number)
+            + " /E " + field(first_page_end) + " /N " + std::to_string(m_pages.size()) + " /T " + field(main_xref_entries)
+            + ">>\nendobj\n";
+    }
+    std::string first_page_trailer(int64_t main_xref) const
+    {
+        return "trailer\n<</Size " + std::to_string(m_hint_stream + m_first_section.size() + 1) + " /Root "
+            + std::to_string(m_objects[m_catalog].m_number) + " 0 R /Prev " + field(main_xref) + ">>\nstartxref\n0\n%%EOF\n";
+    }
+    bool copy(int64_t offset, int64_t length, pdf_writer& out)
+    {
+        byte_vector buffer((size_t)(std::min)(length, (int64_t)1024 * 1024));
+
+        if (!seek(offset))
+        {
+            return false;
+        }
+
+        while (length > 0)
+        {
+            size_t size = (size_t)(std::min)(length, (int64_t)buffer.size());
+
+            if (std::fread(buffer.data(), 1, size, m_source) != size)
+            {
+                return false;
+            }
+
+            out.write(buffer.data(), size);
+
+            length -= (int64_t)size;
+        }
+        return true;
+    }
+    bool copy_all(pdf_writer& out)
+    {
+        byte_vector buffer(1024 * 1024);
+        size_t size;
+
+        if (!seek(0))
+        {
+            return false;
+        }
+
+        while ((size = std::fread(buffer.data(), 1, buffer.size(), m_source)) > 0)
+        {
+            out.write(buffer.data(), size);
+        }
+        return !std::ferror(m_source);
+    }
+    bool write_object(const object_info& obj, pdf_writer& out)
+    {
+        out.put_int(obj.m_number).put(" 0 obj\n").put(obj.m_dict);
+
+        return copy(obj.m_offset + obj.m_tail, obj.m_length - obj.m_tail, out);
+    }
+    bool write_objects(const int_vector& list, pdf_writer& out)
+    {
+        for (int32_t i : list)
+        {
+            if (!write_object(m_objects[i], out))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    void clear()
+    {
+        m_objects.clear();
+        m_pages.clear();
+        m_page_objects.clear();
+        m_first_section.clear();
+        m_shared_first.clear();
+        m_other_pages.clear();
+        m_shared.clear();
+        m_rest.clear();
+    }
+public:
+    linearizer() : m_objects(), m_pages(), m_page_objects()
+    {
+    }
+    // 'source' holds the document as first written: 'offsets' gives the offset of each object
+    // in it (0 for the free ones), 'end' that of its cross-reference section and 'catalog' the number
+    // of the catalog. 'out' must be at the start of the file. A document without pages is copied as it is.
+    // Returns false if the source can't be read, or if the new file is too big for a cross-reference table
+    bool write(FILE* source, const std::vector<int64_t>& offsets, int64_t end, int32_t catalog, pdf_writer& out)
+    {
+        const int64_t max_table_offset = 9999999999LL;
+        int64_t first_xref, catalog_offset, first_section_end, other_pages_end, main_xref, file_end;
+        int64_t hint_offset, hint_size;
+        int32_t first_count; // the objects in the first-page xref section
+        std::string first_xref_start, main_xref_start, main_trailer, hint_dict;
+        byte_vector hints;
+        size_t shared_table;
+        bool result;
+
+        clear();
+
+        m_source = source;
+        m_catalog = catalog;
+
+        try
+        {
+            if (!load_objects(offsets, end))
+            {
+                clear();
+
+                return false;
+            }
+
+            if (!sort_objects())
+            {
+                clear();
+
+                // nothing to linearize
+                return copy_all(out);
+            }
+
+            renumber();
+
+            first_count = m_hint_stream + (int32_t)m_first_section.size() - m_main_count;
+
+            first_xref_start = "xref\n" + std::to_string(m_main_count + 1) + ' ' + std::to_string(first_count) + '\n';
+            main_xref_start = "xref\n0 " + std::to_string(m_main_count + 1);
+
+            // the layout without the hint stream; these are the locations given in the hint tables
+            first_xref = m_header_size + (int64_t)linearization_dict(0, 0, 0, 0, 0).size();
+            catalog_offset = first_xref + (int64_t)first_xref_start.size() + 20 * (int64_t)first_count + (int64_t)first_page_trailer(0).size();
+
+            m_objects[m_catalog].m_new_offset = catalog_offset;
+
+            first_section_end = place(m_first_section, catalog_offset + m_objects[m_catalog].m_size);
+            other_pages_end = place(m_other_pages, first_section_end);
+            main_xref = place(m_rest, place(m_shared, other_pages_end));
+
+            shared_table = write_hint_tables(hints, first_section_end, other_pages_end);
+
+            hint_dict = std::to_string(m_hint_stream) + " 0 obj\n<</Length " + std::to_string(hints.size())
+                + " /S " + std::to_string(shared_table) + ">>\nstream\n";
+
+            main_trailer = "trailer\n<</Size " + std::to_string(m_main_count + 1) + ">>\nstartxref\n" + std::to_string(first_xref) + "\n%%EOF\n";
+        }
+        catch (...)
+        {
+            clear();
+
+            throw std::runtime_error("Out of memory");
+        }
+
+        // the objects after the hint stream move by its size
+        hint_offset = catalog_offset + m_objects[m_catalog].m_size;
+        hint_size = (int64_t)hint_dict.size() + (int64_t)hints.size() + 18;
+
+        first_section_end += hint_size;
+        main_xref += hint_size;
+
+        file_end = main_xref + (int64_t)main_xref_start.size() + 1 + 20 * ((int64_t)m_main_count + 1) + (int64_t)main_trailer.size();
+
+        if (file_end > max_table_offset)
+        {
+            clear();
+
+            return false;
+        }
+
+        result = copy(0, m_header_size, out);
+
+        out.put(linearization_dict(file_end, hint_offset, hint_size, first_section_end, main_xref + (int64_t)main_xref_start.size()));
+
+        // the added objects, the catalog and the first page section
+        out.put(first_xref_start);
+        out.put_xref_entry(m_header_size, 0, 'n');
+        out.put_xref_entry(catalog_offset, 0, 'n');
+        out.put_xref_entry(hint_offset, 0, 'n');
+
+        for (int32_t i : m_first_section)
+        {
+            out.put_xref_entry(m_objects[i].m_new_offset + hint_size, 0, 'n');
+        }
+
+        out.put(first_page_trailer(main_xref));
+
+        result = result && write_object(m_objects[m_catalog], out);
+
+        out.put(hint_dict).write(hints.data(), hints.size()).put("\nendstream\nendobj\n");
+
+        result = result && write_objects(m_first_section, out) && write_objects(m_other_pages, out)
+            && write_objects(m_shared, out) && write_objects(m_rest, out);
+
+        // the startxref points to the first-page section, which links back here
+        out.put(main_xref_start).put('\n');
+        out.put_xref_entry(0, 65535, 'f');
+
+        for (const int_vector* list : { &m_other_pages, &m_shared, &m_rest })
+        {
+            for (int32_t i : *list)
+            {
+                out.put_xref_entry(m_objects[i].m_new_offset + hint_size, 0, 'n');
+            }
+        }
+
+        out.put(main_trailer);
+
+        clear();
+
+        return result;
+    }
+};
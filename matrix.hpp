@@ -12,6 +12,7 @@
 
 #pragma once
 #include "types.h"
+#include "content_writer.hpp"
 
 
 struct matrix
@@ -227,14 +228,12 @@ struct matrix
 		tx = 0;
 		ty = 0;
 	}
-	void write(std::ostringstream& stream, std::string command)
+	void write(content_writer& stream, std::string command)
 	{
-		stream << std::fixed;
 		stream << sx << ' ' << rx << ' ' << ry << ' ' << sy << ' ' << tx << ' ' << ty << ' ' << command << '\n';
 	}
-	friend std::ostream& operator<<(std::ostream& os, const matrix &ctm)
+	friend content_writer& operator<<(content_writer& os, const matrix &ctm)
 	{
-		os << std::fixed;
 		os << ctm.sx << ' ' << ctm.rx << ' ' << ctm.ry << ' ' << ctm.sy << ' ' << ctm.tx << ' ' << ctm.ty << ' ';
 
 		return os;
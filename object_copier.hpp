@@ -0,0 +1,126 @@
+/*
+//  Copyright (c) 2020 Peter Frane Jr. All Rights Reserved.
+//
+//  Use of this source code is governed by the BSD 3-Clause License that can be
+//  found in the LICENSE file.
+//
+//  This software is distributed on an "AS IS" basis, WITHOUT WARRANTY
+//  OF ANY KIND, either express or implied.
+//
+//  For inquiries, email the author at pfranejr AT hotmail.com
+*/
+
+#pragma once
+#include "types.h"
+#include "objects.hpp"
+#include "pdf_writer.hpp"
+#include "pdf_reader.hpp"
+
+// copies objects from a file written by this library to the one being written, together with the
+// objects they refer to. Each copy gets a new number and the references in the dictionaries are
+// renumbered; the streams are copied as they are stored, without decompressing them
+class object_copier
+{
+    pdf_reader& m_reader;
+    object_list& m_objects;
+    std::map<int32_t, int32_t> m_numbers; // the number in the source file, the number in the file being written
+    std::vector<std::pair<int32_t, object_record*>> m_pending; // allocated but not written yet
+public:
+    object_copier(pdf_reader& reader, object_list& objects) : m_reader(reader), m_objects(objects), m_numbers(), m_pending()
+    {
+    }
+    object_copier(const object_copier&) = delete;
+    object_copier& operator=(const object_copier&) = delete;
+
+    // forgets the copies, e.g., when a split document starts a new part; flush() must be called first
+    void clear()
+    {
+        m_numbers.clear();
+    }
+    // the number of the copy of an object; 0 if it isn't copied
+    int32_t find(int32_t number) const
+    {
+        auto it = m_numbers.find(number);
+
+        return (it != m_numbers.end()) ? it->second : 0;
+    }
+    // an object that is already in the file being written, e.g., a font copied from another file
+    void map(int32_t number, int32_t new_number)
+    {
+        try
+        {
+            m_numbers[number] = new_number;
+        }
+        catch (...)
+        {
+            throw std::runtime_error("Out of memory");
+        }
+    }
+    // the number of the copy of an object; the copy is written by flush()
+    int32_t copy(int32_t number)
+    {
+        int32_t new_number = find(number);
+
+        if (0 == new_number)
+        {
+            object_record* obj = m_objects.next_object();
+
+            try
+            {
+                m_numbers.emplace(number, obj->m_number);
+                m_pending.emplace_back(number, obj);
+            }
+            catch (...)
+            {
+                throw std::runtime_error("Out of memory");
+            }
+
+            new_number = obj->m_number;
+        }
+        return new_number;
+    }
+    // writes the copies not written yet and those of the objects they refer to.
+    // Returns false if an object can't be read; it's written as null so the file stays valid
+    bool flush(pdf_writer& out)
+    {
+        std::string dict, data, renumbered;
+        bool is_stream, result = true;
+
+        while (!m_pending.empty())
+        {
+            std::pair<int32_t, object_record*> item = m_pending.back();
+
+            m_pending.pop_back();
+
+            if (!m_reader.read_raw_object(item.first, dict, data, is_stream))
+            {
+                m_objects.begin_object(item.second, out).put("null\n");
+
+                m_objects.end_object(out);
+
+                result = false;
+
+                continue;
+            }
+
+            renumbered.clear();
+
+            pdf_reader::scan_refs(dict, [this](const std::string&, int32_t ref) { return copy(ref); }, &renumbered);
+
+            if (is_stream)
+            {
+                // a stream can't be put in an object stream
+                item.second->write(out);
+
+                out.put(renumbered).put("\nstream\n").write(data.data(), data.size()).put("\nendstream\nendobj\n");
+            }
+            else
+            {
+                m_objects.begin_object(item.second, out).put(renumbered).put('\n');
+
+                m_objects.end_object(out);
+            }
+        }
+        return result;
+    }
+};
@@ -12,143 +12,759 @@
 
 #pragma once
 #include "types.h"
+#include "pdf_writer.hpp"
+#include "compressor.hpp"
+#include <memory>
+#include <deque>
 
 // holds the object numbers and the object offsets
 struct object_record
 {
     int32_t m_number{ 0 };
-    int32_t m_offset{ 0 };
-    void write(FILE* fp)
+    int64_t m_offset{ 0 };
+    int32_t m_stream_number{ 0 }; // the object stream that contains this object; 0 if none
+    int32_t m_stream_index{ 0 }; // the index of this object within the object stream
+    void write(pdf_writer& out)
     {
-        m_offset = ftell(fp);
-        std::fprintf(fp, "%d 0 obj\n", m_number);
+        m_offset = out.offset();
+        out.put_int(m_number).put(" 0 obj\n");
+    }
+};
+
+// collects dictionary objects to be written as one compressed object stream (PDF 1.5)
+class object_stream
+{
+    static const size_t max_objects = 100;
+
+    memory_sink m_sink;
+    pdf_writer m_writer;
+    std::vector<object_record*> m_objects;
+    int_vector m_offsets; // relative to the first object
+    int64_t m_start{ 0 };
+public:
+    object_stream() : m_sink(), m_objects(), m_offsets()
+    {
+        m_writer.attach(m_sink);
+    }
+    bool empty() const
+    {
+        return m_objects.empty();
+    }
+    bool full() const
+    {
+        return m_objects.size() >= max_objects;
+    }
+    // starts a new object; its contents are written to the returned writer
+    pdf_writer& add(object_record* obj)
+    {
+        if (m_objects.empty())
+        {
+            m_start = m_writer.offset();
+        }
+        m_objects.push_back(obj);
+        m_offsets.push_back((int32_t)(m_writer.offset() - m_start));
+
+        return m_writer;
+    }
+    // writes the stream as object 'obj', compressed at the content level of 'profile'
+    void write(object_record* obj, pdf_writer& out, const compression_profile& profile)
+    {
+        std::string header;
+        byte_vector data, dest_data;
+        stream_compressor compressor;
+        char number[16];
+
+        m_writer.flush();
+
+        for (size_t i = 0; i < m_objects.size(); ++i)
+        {
+            snprintf(number, sizeof(number), "%d %d ", m_objects[i]->m_number, m_offsets[i]);
+
+            header.append(number);
+
+            m_objects[i]->m_stream_number = obj->m_number;
+            m_objects[i]->m_stream_index = (int32_t)i;
+        }
+
+        data.assign(header.begin(), header.end());
+
+        {
+            const byte_vector& objects = m_sink.data();
+
+            data.insert(data.end(), objects.begin(), objects.end());
+        }
+
+        obj->write(out);
+
+        {
+            pdf_dictionary dict(out);
+
+            dict.name("/Type", "/ObjStm").integer("/N", (int64_t)m_objects.size()).integer("/First", (int64_t)header.size());
+
+            if (compressor.compress(dest_data, data.data(), data.size(), profile.m_content_level, profile))
+            {
+                dict.name("/Filter", "/FlateDecode").integer("/Length", (int64_t)dest_data.size());
+
+                data.swap(dest_data);
+            }
+            else
+            {
+                dict.integer("/Length", (int64_t)data.size());
+            }
+        }
+
+        out.put("stream\n").write(data.data(), data.size());
+
+        out.put("\nendstream\nendobj\n");
+
+        m_sink.release();
+        m_objects.clear();
+        m_offsets.clear();
     }
 };
 
 
 // holds the list of objects
+// the records are allocated in chunks, so their addresses never change; record n is
+// m_chunks[(n - m_base - 1) / chunk_size][(n - m_base - 1) % chunk_size]. In spill mode, a chunk whose objects
+// have all been written is moved to a temporary file, and only its xref entries are kept
 class object_list
 {
+    static constexpr int32_t chunk_size = 4096;
+
     int m_counter{ 0 };
-    std::vector<object_record*> m_list;
-    object_record* m_page_tree{ nullptr };
+    int m_base{ 0 }; // the objects 1 to m_base belong to the file being appended to
+    std::deque<object_record> m_updated; // objects of that file written again in the update
+    int64_t m_prev_xref{ 0 }; // the last cross-reference section of that file
+    bool m_prev_xref_stream{ false };
+    bool m_pdf15_header{ false };
+    std::vector<std::unique_ptr<object_record[]>> m_chunks;
+    std::unique_ptr<object_record[]> m_spare_chunk; // a spilled chunk kept for reuse
+    FILE* m_spill_file{ nullptr }; // 8 bytes per object; see pack_entry()
     object_record* m_catalog{ nullptr };
-    int_vector m_page_list;
+    int64_t m_xref_offset{ 0 }; // of the cross-reference section written by write_ender()
+    bool m_use_object_streams{ false };
+    object_stream m_object_stream;
+    compression_profile m_compression; // of the object streams and the xref stream
+
+    // the xref entry of an object packed into 64 bits:
+    // > 0: the file offset; < 0: the object stream number and the index; 0: a free entry
+    static int64_t pack_entry(const object_record& obj)
+    {
+        if (obj.m_stream_number != 0)
+        {
+            return -(((int64_t)obj.m_stream_number << 16) | obj.m_stream_index);
+        }
+        return obj.m_offset;
+    }
+    static void unpack_entry(int64_t entry, uint32_t& type, uint64_t& field2, uint32_t& field3)
+    {
+        if (entry > 0)
+        {
+            type = 1;
+            field2 = (uint64_t)entry;
+            field3 = 0;
+        }
+        else if (entry < 0)
+        {
+            type = 2;
+            field2 = (uint64_t)(-entry) >> 16;
+            field3 = (uint32_t)((-entry) & 0xffff);
+        }
+        else
+        {
+            // allocated but never written
+            type = 0;
+            field2 = 0;
+            field3 = 65535;
+        }
+    }
+    static bool seek_spill_file(FILE* fp, int64_t offset)
+    {
+#ifdef _WIN32
+        return 0 == _fseeki64(fp, offset, SEEK_SET);
+#else
+        return 0 == fseeko(fp, (off_t)offset, SEEK_SET);
+#endif
+    }
+    // the number of objects in the chunk
+    int32_t chunk_count(size_t chunk) const
+    {
+        return (std::min)(chunk_size, m_counter - m_base - (int32_t)chunk * chunk_size);
+    }
+    // moves the chunks whose objects have all been written to the spill file;
+    // the chunk in use and the ones with objects not yet written (e.g., the fonts) stay in memory
+    void spill_chunks()
+    {
+        for (size_t i = 0; i + 1 < m_chunks.size(); ++i)
+        {
+            object_record* records = m_chunks[i].get();
+            std::vector<int64_t> entries;
+            int32_t j;
+
+            if (!records)
+            {
+                continue;
+            }
 
-    void write_xref(FILE* fp)
+            entries.resize(chunk_size);
+
+            for (j = 0; j < chunk_size; ++j)
+            {
+                if (0 == records[j].m_offset && 0 == records[j].m_stream_number)
+                {
+                    break;
+                }
+                entries[j] = pack_entry(records[j]);
+            }
+
+            if (j == chunk_size
+                && seek_spill_file(m_spill_file, (int64_t)i * chunk_size * sizeof(int64_t))
+                && std::fwrite(entries.data(), sizeof(int64_t), chunk_size, m_spill_file) == (size_t)chunk_size)
+            {
+                if (!m_spare_chunk)
+                {
+                    m_spare_chunk = std::move(m_chunks[i]);
+                }
+                m_chunks[i].reset();
+            }
+        }
+    }
+    // the packed xref entries of the objects in the chunk
+    bool load_entries(size_t chunk, std::vector<int64_t>& entries)
     {
-        long xref = std::ftell(fp);
-        int object_count = (int)(m_list.size() + 1);
-        int generation_number = object_count;
+        int32_t count = chunk_count(chunk);
+        const object_record* records = m_chunks[chunk].get();
+
+        entries.resize(count);
 
-        std::fprintf(fp, "xref\n0 %u\n", object_count);
+        if (records)
+        {
+            for (int32_t i = 0; i < count; ++i)
+            {
+                entries[i] = pack_entry(records[i]);
+            }
+            return true;
+        }
+
+        std::fflush(m_spill_file);
+
+        return seek_spill_file(m_spill_file, (int64_t)chunk * chunk_size * sizeof(int64_t))
+            && std::fread(entries.data(), sizeof(int64_t), count, m_spill_file) == (size_t)count;
+    }
+    // the objects written again in an update, by object number
+    std::vector<const object_record*> sorted_updates() const
+    {
+        std::vector<const object_record*> list;
+
+        for (const object_record& obj : m_updated)
+        {
+            list.push_back(&obj);
+        }
+
+        std::sort(list.begin(), list.end(), [](const object_record* a, const object_record* b) { return a->m_number < b->m_number; });
+
+        return list;
+    }
+    void release_chunks()
+    {
+        m_chunks.clear();
+        m_chunks.shrink_to_fit();
+        m_spare_chunk.reset();
+
+        if (m_spill_file)
+        {
+            // a temporary file; deleted when closed
+            std::fclose(m_spill_file);
+
+            m_spill_file = nullptr;
+        }
+    }
+
+    void write_object_stream(pdf_writer& out)
+    {
+        if (!m_object_stream.empty())
+        {
+            m_object_stream.write(next_object(), out, m_compression);
+        }
+    }
+    // PDF 1.5 cross-reference stream; replaces the xref table and the trailer
+    void write_xref_stream(pdf_writer& out)
+    {
+        object_record* xref = next_object();
+        int object_count = m_counter + 1;
+        int offset_width = 1;
+        int row_width;
+        byte_vector data, dest_data;
+        stream_compressor compressor;
+        std::string index; // the /Index entry of an update
+
+        // the stream includes its own entry
+        xref->m_offset = m_xref_offset = out.offset();
+
+        // no offset is bigger than that of this stream, and no object stream number is bigger than the object count
+        while (offset_width < 8 && ((uint64_t)(std::max)(xref->m_offset, (int64_t)m_counter) >> (offset_width * 8)) != 0)
+        {
+            ++offset_width;
+        }
 
-        std::fputs("0000000000 65535 f\r\n", fp);
+        // type, offset (or object stream number), generation (or index);
+        // each row is preceded by the PNG predictor byte
+        row_width = 1 + offset_width + 2;
 
-        for (object_record* obj : m_list)
         {
-            if (obj->m_offset != 0)
+            std::vector<const object_record*> updates = sorted_updates();
+            size_t row_count = updates.size() + (size_t)(m_counter - m_base) + ((0 == m_base) ? 1 : 0);
+            byte_vector previous(row_width, 0);
+            byte_vector current(row_width, 0);
+            std::vector<int64_t> entries;
+            byte_t* row;
+
+            auto add_row = [&](int64_t entry)
             {
-                std::fprintf(fp, "%010d 00000 n\r\n", obj->m_offset);
+                uint32_t type, field3;
+                uint64_t field2;
+
+                unpack_entry(entry, type, field2, field3);
+
+                current[0] = (byte_t)type;
+
+                for (int j = offset_width; j >= 1; --j)
+                {
+                    current[j] = (byte_t)(field2 & 0xff);
+                    field2 >>= 8;
+                }
+                current[row_width - 2] = (byte_t)(field3 >> 8);
+                current[row_width - 1] = (byte_t)(field3 & 0xff);
+
+                // PNG Up filter; the columns barely change from one row to the next
+                *row++ = 2;
+
+                for (int j = 0; j < row_width; ++j)
+                {
+                    *row++ = (byte_t)(current[j] - previous[j]);
+                }
+                previous.swap(current);
+            };
+
+            data.resize((size_t)(row_width + 1) * row_count);
+
+            row = data.data();
+
+            if (0 == m_base)
+            {
+                // object 0, the head of the free list
+                add_row(0);
             }
             else
             {
-                std::fprintf(fp, "%010d %05d f\r\n", obj->m_offset, ++generation_number);
+                index = "[";
+
+                for (const object_record* obj : updates)
+                {
+                    index += std::to_string(obj->m_number) + " 1 ";
+
+                    add_row(pack_entry(*obj));
+                }
+
+                index += std::to_string(m_base + 1) + ' ' + std::to_string(m_counter - m_base) + ']';
             }
+
+            for (size_t chunk = 0; chunk < m_chunks.size(); ++chunk)
+            {
+                if (!load_entries(chunk, entries))
+                {
+                    // the spill file could not be read
+                    entries.assign(entries.size(), 0);
+                }
+
+                for (int64_t entry : entries)
+                {
+                    add_row(entry);
+                }
+            }
+        }
+
+        xref->write(out);
+
+        pdf_dictionary dict(out);
+        const int32_t widths[] = { 1, offset_width, 2 };
+
+        dict.name("/Type", "/XRef").integer("/Size", object_count).ref("/Root", m_catalog->m_number).integers("/W", widths, 3);
+
+        if (!index.empty())
+        {
+            dict.value("/Index").put(index).put('\n');
         }
 
-        std::fprintf(fp, "trailer\n<</Size %u\n/Root 2 0 R\n>>\n", object_count);
+        if (m_prev_xref != 0)
+        {
+            dict.integer("/Prev", m_prev_xref);
+        }
+
+        if (compressor.compress(dest_data, data.data(), data.size(), m_compression.m_content_level, m_compression))
+        {
+            dict.name("/Filter", "/FlateDecode");
+
+            pdf_dictionary(dict.value("/DecodeParms")).integer("/Columns", row_width).integer("/Predictor", 12);
+
+            dict.integer("/Length", (int64_t)dest_data.size());
+
+            dict.end();
+
+            out.put("stream\n");
 
-        std::fprintf(fp, "startxref\n%ld\n%%%%EOF", xref);
+            out.write(dest_data.data(), dest_data.size());
+        }
+        else
+        {
+            // the predictor applies only to a filter; undo it and write the plain rows
+            byte_vector previous(row_width, 0);
+
+            size_t row_count = data.size() / (row_width + 1);
+
+            dict.integer("/Length", (int64_t)(row_width * row_count));
+
+            dict.end();
+
+            out.put("stream\n");
+
+            for (size_t i = 0; i < row_count; ++i)
+            {
+                const byte_t* row = data.data() + (size_t)(row_width + 1) * i + 1;
+
+                for (int j = 0; j < row_width; ++j)
+                {
+                    previous[j] = (byte_t)(previous[j] + row[j]);
+                }
+                out.write(previous.data(), row_width);
+            }
+        }
+
+        out.put("\nendstream\nendobj\n");
+
+        out.put("startxref\n").put_int(xref->m_offset).put("\n%%EOF");
     }
 
-    void write_page_tree(FILE* fp)
+    static void put_table_entry(pdf_writer& out, int64_t entry)
     {
-        m_page_tree->write(fp);
+        if (entry > 0)
+        {
+            out.put_xref_entry(entry, 0, 'n');
+        }
+        else
+        {
+            // allocated but never written; the generation must fit the 5-digit field
+            out.put_xref_entry(0, 65535, 'f');
+        }
+    }
+    void write_xref(pdf_writer& out)
+    {
+        int64_t xref = m_xref_offset = out.offset();
+        int object_count = m_counter + 1;
+        std::vector<int64_t> entries;
+
+        if (0 == m_base)
+        {
+            out.put("xref\n0 ").put_int(object_count).put('\n');
+
+            out.put_xref_entry(0, 65535, 'f');
+        }
+        else
+        {
+            // an update lists only the objects it writes: one subsection for each object
+            // written again, and one for the new objects. Some readers expect object 0 first
+            out.put("xref\n0 1\n");
+
+            out.put_xref_entry(0, 65535, 'f');
+
+            for (const object_record* obj : sorted_updates())
+            {
+                out.put_int(obj->m_number).put(" 1\n");
+
+                put_table_entry(out, pack_entry(*obj));
+            }
+
+            out.put_int(m_base + 1).put(' ').put_int(m_counter - m_base).put('\n');
+        }
+
+        for (size_t chunk = 0; chunk < m_chunks.size(); ++chunk)
+        {
+            if (!load_entries(chunk, entries))
+            {
+                // the spill file could not be read
+                entries.assign(entries.size(), 0);
+            }
 
-        std::fprintf(fp, "<</Type /Pages\n/Count %u\n/Kids [\n", (unsigned)m_page_list.size());
+            for (int64_t entry : entries)
+            {
+                put_table_entry(out, entry);
+            }
+        }
 
-        for (int i : m_page_list)
         {
-            std::fprintf(fp, "\t%d 0 R\n", i);
+            pdf_dictionary dict(out.put("trailer\n"));
+
+            dict.integer("/Size", object_count).ref("/Root", m_catalog->m_number);
+
+            if (m_prev_xref != 0)
+            {
+                dict.integer("/Prev", m_prev_xref);
+            }
         }
 
-        std::fputs("\t]\n>>\nendobj\n", fp);
+        out.put("startxref\n").put_int(xref).put("\n%%EOF");
     }
 
-    void write_catalog(FILE* fp)
+    void write_catalog(pdf_writer& out, int32_t page_tree_root, bool pdf15)
     {
-        m_catalog->write(fp);
+        pdf_dictionary dict(begin_object(m_catalog, out));
 
-        std::fputs("<</Type /Catalog\n/Pages 1 0 R\n>>\nendobj\n", fp);
+        dict.name("/Type", "/Catalog").ref("/Pages", page_tree_root);
+
+        if (pdf15 && !m_pdf15_header)
+        {
+            // the header says 1.4; this overrides it for the cross-reference stream
+            dict.name("/Version", "/1.5");
+        }
+
+        dict.end();
+
+        end_object(out);
     }
 
 public:
-    object_list() : m_list(), m_page_list()
+    object_list() : m_chunks()
     {
-        m_list.reserve(32);
-        m_page_list.reserve(32);
-
-        m_page_tree = next_object();
         m_catalog = next_object();
     }
+    object_list(const object_list&) = delete;
+    object_list& operator=(const object_list&) = delete;
     ~object_list()
     {
-        m_list.clear();
+        clear();
     }
+    // releases the records; the list can't be used afterwards
     void clear()
     {
-        m_list.clear();
-        m_page_list.clear();    }
+        release_chunks();
 
-    object_record* next_object()  // create a new object
+        m_updated.clear();
+
+        m_counter = 0;
+        m_base = 0;
+        m_catalog = nullptr;
+    }
+
+    // starts the objects of a new file, e.g., the next part of a split document; the options are kept
+    void restart()
     {
-        object_record* tmp = new object_record;
+        bool spill = m_spill_file != nullptr;
+
+        clear();
+
+        m_xref_offset = 0;
 
-        if (tmp)
+        if (spill)
         {
-            try
-            {
-                tmp->m_number = ++m_counter;
+            spill_to_file();
+        }
+
+        m_catalog = next_object();
+    }
 
-                m_list.push_back(tmp);
+    object_record* next_object()  // create a new object
+    {
+        size_t chunk = (size_t)(m_counter - m_base) / chunk_size;
 
-                return tmp;
-            }
-            catch (...)
+        try
+        {
+            if (chunk == m_chunks.size())
             {
+                if (m_spill_file)
+                {
+                    spill_chunks();
+                }
+
+                if (m_spare_chunk)
+                {
+                    std::fill(m_spare_chunk.get(), m_spare_chunk.get() + chunk_size, object_record());
+
+                    m_chunks.push_back(std::move(m_spare_chunk));
+                }
+                else
+                {
+                    m_chunks.emplace_back(new object_record[chunk_size]);
+                }
             }
         }
+        catch (...)
+        {
+            throw std::runtime_error("Out of memory");
+        }
+
+        object_record* tmp = &m_chunks[chunk][(m_counter - m_base) % chunk_size];
 
-        throw std::runtime_error("Out of memory");
+        tmp->m_number = ++m_counter;
+
+        return tmp;
     }
 
-    object_record* new_page_object() // create a new object for page use
+    // continues the objects of an existing file: the new objects are numbered from 'size',
+    // and the xref section links to the one at 'prev_xref'. Call this before creating any object
+    void append_to(int32_t size, int32_t catalog, int64_t prev_xref, bool prev_xref_stream, bool pdf15_header)
     {
-        object_record* tmp = next_object();
+        m_chunks.clear();
+        m_updated.clear();
+
+        m_counter = m_base = size - 1;
+        m_prev_xref = prev_xref;
+        m_prev_xref_stream = prev_xref_stream;
+        m_pdf15_header = pdf15_header;
 
+        m_catalog = update_object(catalog);
+    }
+    // an object of the file being appended to that is written again
+    object_record* update_object(int32_t number)
+    {
         try
         {
-            m_page_list.push_back(tmp->m_number); // add the page number for use in the root node
-
-            return tmp;
+            m_updated.emplace_back();
         }
         catch (...)
         {
-            if (tmp)
-            {
-                delete tmp;
-            }
             throw std::runtime_error("Out of memory");
         }
+
+        m_updated.back().m_number = number;
+
+        return &m_updated.back();
     }
+    // keeps the xref entries of the written objects in a temporary file instead of in memory,
+    // for documents with millions of objects. A record must not be used once its object
+    // has been written. Returns false if the temporary file can't be created
+    bool spill_to_file()
+    {
+        if (!m_spill_file && tmpfile_s(&m_spill_file) != 0)
+        {
+            m_spill_file = nullptr;
 
+            return false;
+        }
+        return true;
+    }
 
-    void write_ender(FILE* fp)
+    // PDF 1.5: the dictionaries are packed into compressed object streams and
+    // the xref table is replaced by a cross-reference stream; call this before writing any object
+    void use_object_streams(bool value)
     {
-        write_page_tree(fp);
-        write_catalog(fp);
-        write_xref(fp);
+        m_use_object_streams = value;
+        m_pdf15_header = value;
+    }
+    bool use_object_streams() const
+    {
+        return m_use_object_streams;
+    }
+    // the object streams and the xref stream are compressed like the page contents
+    void use_compression_profile(const compression_profile& profile)
+    {
+        m_compression = profile;
+    }
+    // starts a dictionary object (one without a stream); its contents are written to the returned writer
+    pdf_writer& begin_object(object_record* obj, pdf_writer& out)
+    {
+        if (m_use_object_streams)
+        {
+            return m_object_stream.add(obj);
+        }
+
+        obj->write(out);
+
+        return out;
+    }
+    // ends the object started by begin_object; 'out' is the same writer passed to begin_object
+    void end_object(pdf_writer& out)
+    {
+        if (!m_use_object_streams)
+        {
+            out.put("endobj\n");
+        }
+        else if (m_object_stream.full())
+        {
+            write_object_stream(out);
+        }
+    }
+    // the number of objects allocated so far
+    int32_t object_count() const
+    {
+        return m_counter;
+    }
+    int32_t catalog_number() const
+    {
+        return m_catalog->m_number;
+    }
+    int64_t xref_offset() const
+    {
+        return m_xref_offset;
+    }
+    // the offset of each object, indexed by the object number; 0 for the objects never written.
+    // Fails if an object is in an object stream, or if the spill file can't be read
+    bool get_offsets(std::vector<int64_t>& offsets)
+    {
+        std::vector<int64_t> entries;
+
+        if (m_base != 0)
+        {
+            return false;
+        }
+
+        offsets.assign((size_t)m_counter + 1, 0);
+
+        for (size_t chunk = 0; chunk < m_chunks.size(); ++chunk)
+        {
+            if (!load_entries(chunk, entries))
+            {
+                return false;
+            }
+
+            for (size_t i = 0; i < entries.size(); ++i)
+            {
+                if (entries[i] < 0)
+                {
+                    return false;
+                }
+
+                offsets[chunk * chunk_size + i + 1] = entries[i];
+            }
+        }
+        return true;
+    }
+    // 'page_tree_root' is the root node written by the page_tree
+    void write_ender(pdf_writer& out, int32_t page_tree_root)
+    {
+        // the offsets in the xref table are limited to 10 digits; a bigger file needs a cross-reference stream.
+        // the objects are written in order, so no offset can exceed that of the catalog
+        const int64_t max_table_offset = 9999999999LL;
+        bool xref_stream;
+
+        // an update keeps the kind of cross-reference section of the file
+        xref_stream = m_use_object_streams || m_prev_xref_stream || out.offset() > max_table_offset;
+
+        write_catalog(out, page_tree_root, xref_stream);
+
+        if (m_use_object_streams)
+        {
+            write_object_stream(out);
+        }
+
+        if (xref_stream)
+        {
+            write_xref_stream(out);
+        }
+        else
+        {
+            write_xref(out);
+        }
     }
 
 };
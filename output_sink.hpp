@@ -0,0 +1,785 @@
+/*
+//  Copyright (c) 2020 Peter Frane Jr. All Rights Reserved.
+//
+//  Use of this source code is governed by the BSD 3-Clause License that can be
+//  found in the LICENSE file.
+//
+//  This software is distributed on an "AS IS" basis, WITHOUT WARRANTY
+//  OF ANY KIND, either express or implied.
+//
+//  For inquiries, email the author at pfranejr AT hotmail.com
+*/
+
+#pragma once
+#include "types.h"
+#include <cstdarg>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <share.h>
+#include <sys/stat.h>
+#else
+#include <unistd.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+// how create(filename) writes the file
+enum class file_backend
+{
+    stdio, // a FILE*; see file_sink
+    async, // on a background thread; see async_file_sink
+    mapped // through a memory-mapped file; see mapped_file_sink
+};
+
+// base class of the output destinations
+// the sink counts the bytes written so that the object offsets never depend on ftell;
+// this allows writing to destinations that cannot seek, like pipes and sockets
+class output_sink
+{
+    int64_t m_offset{ 0 };
+    bool m_failed{ false };
+protected:
+    // writes the whole buffer; returns false on failure
+    virtual bool do_write(const void* data, size_t size) = 0;
+    // for a destination that already holds data, e.g., a file being appended to
+    void start_offset(int64_t offset)
+    {
+        m_offset = offset;
+    }
+    // for a failure found outside write(), e.g., by close()
+    void set_failed()
+    {
+        m_failed = true;
+    }
+public:
+    output_sink() = default;
+    output_sink(const output_sink&) = delete;
+    output_sink& operator=(const output_sink&) = delete;
+    virtual ~output_sink() = default;
+
+    bool write(const void* data, size_t size)
+    {
+        if (0 == size)
+        {
+            return true;
+        }
+        else if (do_write(data, size))
+        {
+            m_offset += (int64_t)size;
+
+            return true;
+        }
+
+        m_failed = true;
+
+        return false;
+    }
+    bool write_string(const char* str)
+    {
+        return write(str, strlen(str));
+    }
+    bool write_char(char ch)
+    {
+        return write(&ch, 1);
+    }
+    bool write_format(const char* format, ...)
+    {
+        char buffer[256];
+        va_list args;
+        int length;
+
+        va_start(args, format);
+        length = vsnprintf(buffer, sizeof(buffer), format, args);
+        va_end(args);
+
+        if (length < 0)
+        {
+            m_failed = true;
+
+            return false;
+        }
+        else if ((size_t)length < sizeof(buffer))
+        {
+            return write(buffer, (size_t)length);
+        }
+        else
+        {
+            // too big for the local buffer
+            std::vector<char> tmp((size_t)length + 1);
+
+            va_start(args, format);
+            vsnprintf(tmp.data(), tmp.size(), format, args);
+            va_end(args);
+
+            return write(tmp.data(), (size_t)length);
+        }
+    }
+    // the number of bytes written so far; this is the offset of the next byte.
+    // always 64-bit, so documents may grow past 2 GB even where long is 32-bit
+    int64_t offset() const
+    {
+        return m_offset;
+    }
+    // true if any of the writes failed
+    bool failed() const
+    {
+        return m_failed;
+    }
+    virtual bool flush()
+    {
+        return true;
+    }
+    virtual void close()
+    {
+    }
+};
+
+// writes to a FILE*; the file is closed only if it was opened by this object
+class file_sink : public output_sink
+{
+    FILE* m_fp{ nullptr };
+    bool m_owner{ false };
+protected:
+    bool do_write(const void* data, size_t size) override
+    {
+        return m_fp && std::fwrite(data, 1, size, m_fp) == size;
+    }
+public:
+    file_sink() = default;
+    explicit file_sink(FILE* fp) : m_fp(fp)
+    {
+    }
+    ~file_sink()
+    {
+        close();
+    }
+    bool open(const char* filename)
+    {
+        FILE* tmp = nullptr;
+
+        close();
+
+        fopen_s(&tmp, filename, "wb");
+
+        if (!tmp)
+        {
+            return false;
+        }
+
+        // the sink may be reused for another file
+        start_offset(0);
+
+        m_fp = tmp;
+        m_owner = true;
+
+        return true;
+    }
+    // opens an existing file and writes at its end; the offsets continue from there
+    bool open_append(const char* filename)
+    {
+        FILE* tmp = nullptr;
+        int64_t size;
+
+        close();
+
+        fopen_s(&tmp, filename, "ab");
+
+        if (!tmp)
+        {
+            return false;
+        }
+#ifdef _WIN32
+        size = (0 == _fseeki64(tmp, 0, SEEK_END)) ? _ftelli64(tmp) : -1;
+#else
+        size = (0 == fseeko(tmp, 0, SEEK_END)) ? (int64_t)ftello(tmp) : -1;
+#endif
+        if (size < 0)
+        {
+            std::fclose(tmp);
+
+            return false;
+        }
+
+        start_offset(size);
+
+        m_fp = tmp;
+        m_owner = true;
+
+        return true;
+    }
+    // a temporary file, deleted when it's closed; it can be read back through file()
+    bool open_temporary()
+    {
+        FILE* tmp = nullptr;
+
+        close();
+
+        if (tmpfile_s(&tmp) != 0 || !tmp)
+        {
+            return false;
+        }
+
+        start_offset(0);
+
+        m_fp = tmp;
+        m_owner = true;
+
+        return true;
+    }
+    bool is_open() const
+    {
+        return m_fp != nullptr;
+    }
+    FILE* file() const
+    {
+        return m_fp;
+    }
+    bool flush() override
+    {
+        return m_fp && std::fflush(m_fp) == 0;
+    }
+    void close() override
+    {
+        if (m_fp && m_owner)
+        {
+            std::fclose(m_fp);
+        }
+        m_fp = nullptr;
+        m_owner = false;
+    }
+};
+
+// keeps the whole document in memory
+class memory_sink : public output_sink
+{
+    byte_vector m_buffer;
+protected:
+    bool do_write(const void* data, size_t size) override
+    {
+        try
+        {
+            const byte_t* p = (const byte_t*)data;
+
+            m_buffer.insert(m_buffer.end(), p, p + size);
+
+            return true;
+        }
+        catch (...)
+        {
+            return false;
+        }
+    }
+public:
+    memory_sink() : m_buffer()
+    {
+    }
+    explicit memory_sink(size_t initial_capacity) : m_buffer()
+    {
+        m_buffer.reserve(initial_capacity);
+    }
+    const byte_vector& data() const
+    {
+        return m_buffer;
+    }
+    size_t size() const
+    {
+        return m_buffer.size();
+    }
+    // moves the contents out of the sink
+    byte_vector release()
+    {
+        byte_vector tmp;
+
+        tmp.swap(m_buffer);
+
+        return tmp;
+    }
+};
+
+// writes to a file descriptor: an opened file, a pipe or a socket (POSIX);
+// the descriptor is not closed by the sink
+class fd_sink : public output_sink
+{
+    int m_fd{ -1 };
+protected:
+    bool do_write(const void* data, size_t size) override
+    {
+        return write_all(m_fd, data, size);
+    }
+public:
+    explicit fd_sink(int fd) : m_fd(fd)
+    {
+    }
+    // writes the whole buffer to a file descriptor, in several calls if needed
+    static bool write_all(int fd, const void* data, size_t size)
+    {
+        const char* p = (const char*)data;
+
+        while (size > 0)
+        {
+#ifdef _WIN32
+            unsigned count = (unsigned)((size > 0x40000000) ? 0x40000000 : size);
+            int written = _write(fd, p, count);
+
+            if (written <= 0)
+            {
+                return false;
+            }
+#else
+            ssize_t written = ::write(fd, p, size);
+
+            if (written < 0)
+            {
+                if (EINTR == errno)
+                {
+                    continue;
+                }
+                return false;
+            }
+            else if (0 == written)
+            {
+                return false;
+            }
+#endif
+            p += written;
+            size -= (size_t)written;
+        }
+        return true;
+    }
+};
+
+// writes to a file on a background thread. The data is collected in large blocks, and each full
+// block is handed to the thread, so the thread building the pages doesn't wait for the disk unless
+// all the blocks are waiting to be written. flush() waits until everything is in the file
+class async_file_sink : public output_sink
+{
+    static const size_t block_size = 1024 * 1024;
+    static const size_t max_queued_blocks = 4;
+
+    int m_fd{ -1 };
+    byte_vector m_block; // being filled
+    std::deque<byte_vector> m_queue; // full blocks waiting for the thread
+    std::vector<byte_vector> m_spare_blocks; // written, kept for reuse
+    bool m_writing{ false }; // the thread is writing a block
+    bool m_stop{ false };
+    bool m_error{ false };
+    std::mutex m_mutex;
+    std::condition_variable m_block_queued; // or the thread must stop
+    std::condition_variable m_block_written;
+    std::thread m_thread;
+private:
+    void writer()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        for (;;)
+        {
+            byte_vector block;
+            bool result;
+
+            m_block_queued.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+
+            if (m_queue.empty())
+            {
+                return;
+            }
+
+            block.swap(m_queue.front());
+
+            m_queue.pop_front();
+
+            m_writing = true;
+
+            lock.unlock();
+
+            result = fd_sink::write_all(m_fd, block.data(), block.size());
+
+            lock.lock();
+
+            m_writing = false;
+
+            if (!result)
+            {
+                m_error = true;
+            }
+
+            if (m_spare_blocks.size() < max_queued_blocks)
+            {
+                block.clear();
+
+                m_spare_blocks.push_back(std::move(block));
+            }
+
+            m_block_written.notify_all();
+        }
+    }
+    // hands the block being filled to the thread; false if a write failed
+    bool queue_block()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        m_block_written.wait(lock, [this] { return m_queue.size() < max_queued_blocks || m_error; });
+
+        if (m_error)
+        {
+            return false;
+        }
+
+        m_queue.push_back(std::move(m_block));
+
+        m_block.clear();
+
+        if (!m_spare_blocks.empty())
+        {
+            m_block.swap(m_spare_blocks.back());
+
+            m_spare_blocks.pop_back();
+        }
+
+        m_block_queued.notify_one();
+
+        return true;
+    }
+protected:
+    bool do_write(const void* data, size_t size) override
+    {
+        const byte_t* p = (const byte_t*)data;
+
+        if (m_fd < 0)
+        {
+            return false;
+        }
+
+        while (size > 0)
+        {
+            size_t count = (std::min)(size, block_size - m_block.size());
+
+            try
+            {
+                m_block.reserve(block_size);
+                m_block.insert(m_block.end(), p, p + count);
+            }
+            catch (...)
+            {
+                return false;
+            }
+
+            p += count;
+            size -= count;
+
+            if (m_block.size() == block_size && !queue_block())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+public:
+    async_file_sink() = default;
+    ~async_file_sink()
+    {
+        close();
+    }
+    bool open(const char* filename)
+    {
+        close();
+
+#ifdef _WIN32
+        _sopen_s(&m_fd, filename, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _SH_DENYWR, _S_IREAD | _S_IWRITE);
+#else
+        m_fd = ::open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+        if (m_fd < 0)
+        {
+            return false;
+        }
+
+        m_stop = false;
+        m_error = false;
+
+        try
+        {
+            m_thread = std::thread(&async_file_sink::writer, this);
+        }
+        catch (...)
+        {
+            close();
+
+            return false;
+        }
+
+        start_offset(0);
+
+        return true;
+    }
+    bool is_open() const
+    {
+        return m_fd >= 0;
+    }
+    bool flush() override
+    {
+        if (m_fd < 0 || (!m_block.empty() && !queue_block()))
+        {
+            return false;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        m_block_written.wait(lock, [this] { return (m_queue.empty() && !m_writing) || m_error; });
+
+        return !m_error;
+    }
+    void close() override
+    {
+        if (m_fd < 0)
+        {
+            return;
+        }
+
+        if (!flush())
+        {
+            set_failed();
+        }
+
+        if (m_thread.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+
+                m_stop = true;
+            }
+
+            m_block_queued.notify_one();
+
+            m_thread.join();
+        }
+
+#ifdef _WIN32
+        _close(m_fd);
+#else
+        ::close(m_fd);
+#endif
+        m_fd = -1;
+
+        m_block.clear();
+        m_queue.clear();
+        m_spare_blocks.clear();
+    }
+};
+
+// writes into a memory-mapped file that grows as needed, so a write is only a memory copy, and the
+// system moves the pages to the disk in the background. The mapping starts at 'initial_size' bytes
+// and doubles when it's full; close() cuts the file to the size written
+class mapped_file_sink : public output_sink
+{
+    int64_t m_initial_size;
+    byte_t* m_view{ nullptr };
+    int64_t m_capacity{ 0 }; // the size of the mapping
+    int64_t m_size{ 0 }; // the bytes written
+#ifdef _WIN32
+    HANDLE m_file{ INVALID_HANDLE_VALUE };
+    HANDLE m_mapping{ nullptr };
+#else
+    int m_fd{ -1 };
+#endif
+private:
+    void unmap()
+    {
+#ifdef _WIN32
+        if (m_view)
+        {
+            UnmapViewOfFile(m_view);
+        }
+        if (m_mapping)
+        {
+            CloseHandle(m_mapping);
+
+            m_mapping = nullptr;
+        }
+#else
+        if (m_view)
+        {
+            munmap(m_view, (size_t)m_capacity);
+        }
+#endif
+        m_view = nullptr;
+        m_capacity = 0;
+    }
+    // maps the file again with room for at least 'size' bytes; the file grows with the mapping
+    bool map(int64_t size)
+    {
+        int64_t capacity = (std::max)(m_capacity, m_initial_size);
+
+        while (capacity < size)
+        {
+            capacity *= 2;
+        }
+
+        unmap();
+
+#ifdef _WIN32
+        m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READWRITE, (DWORD)(capacity >> 32), (DWORD)capacity, nullptr);
+
+        if (m_mapping)
+        {
+            m_view = (byte_t*)MapViewOfFile(m_mapping, FILE_MAP_WRITE, 0, 0, (SIZE_T)capacity);
+        }
+#else
+        if (ftruncate(m_fd, (off_t)capacity) == 0)
+        {
+            void* view = mmap(nullptr, (size_t)capacity, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+
+            m_view = (view != MAP_FAILED) ? (byte_t*)view : nullptr;
+        }
+#endif
+        if (!m_view)
+        {
+            unmap();
+
+            return false;
+        }
+
+        m_capacity = capacity;
+
+        return true;
+    }
+protected:
+    bool do_write(const void* data, size_t size) override
+    {
+        if (!is_open() || (m_size + (int64_t)size > m_capacity && !map(m_size + (int64_t)size)))
+        {
+            return false;
+        }
+
+        std::memcpy(m_view + m_size, data, size);
+
+        m_size += (int64_t)size;
+
+        return true;
+    }
+public:
+    explicit mapped_file_sink(int64_t initial_size = 16 * 1024 * 1024) : m_initial_size((std::max)(initial_size, (int64_t)65536))
+    {
+    }
+    ~mapped_file_sink()
+    {
+        close();
+    }
+    bool open(const char* filename)
+    {
+        close();
+
+#ifdef _WIN32
+        m_file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+#else
+        m_fd = ::open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+#endif
+        if (!is_open())
+        {
+            return false;
+        }
+
+        m_size = 0;
+
+        start_offset(0);
+
+        return true;
+    }
+    bool is_open() const
+    {
+#ifdef _WIN32
+        return m_file != INVALID_HANDLE_VALUE;
+#else
+        return m_fd >= 0;
+#endif
+    }
+    // the data is already in the system's cache
+    bool flush() override
+    {
+        return is_open();
+    }
+    void close() override
+    {
+        if (!is_open())
+        {
+            return;
+        }
+
+        unmap();
+
+#ifdef _WIN32
+        {
+            LARGE_INTEGER size;
+
+            size.QuadPart = m_size;
+
+            if (!SetFilePointerEx(m_file, size, nullptr, FILE_BEGIN) || !SetEndOfFile(m_file))
+            {
+                set_failed();
+            }
+        }
+
+        CloseHandle(m_file);
+
+        m_file = INVALID_HANDLE_VALUE;
+#else
+        if (ftruncate(m_fd, (off_t)m_size) != 0)
+        {
+            set_failed();
+        }
+
+        ::close(m_fd);
+
+        m_fd = -1;
+#endif
+        m_size = 0;
+    }
+};
+
+// writes to a C++ stream, which need not be seekable
+class stream_sink : public output_sink
+{
+    std::ostream& m_stream;
+protected:
+    bool do_write(const void* data, size_t size) override
+    {
+        m_stream.write((const char*)data, (std::streamsize)size);
+
+        return m_stream.good();
+    }
+public:
+    explicit stream_sink(std::ostream& stream) : m_stream(stream)
+    {
+    }
+    bool flush() override
+    {
+        m_stream.flush();
+
+        return m_stream.good();
+    }
+};
+
+// hands each block to a user function, e.g., one that sends it to an HTTP client
+class callback_sink : public output_sink
+{
+public:
+    using write_function = std::function<bool(const void* data, size_t size)>;
+private:
+    write_function m_write;
+protected:
+    bool do_write(const void* data, size_t size) override
+    {
+        return m_write && m_write(data, size);
+    }
+public:
+    explicit callback_sink(write_function fn) : m_write(std::move(fn))
+    {
+    }
+};
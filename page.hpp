@@ -17,6 +17,10 @@
 #include "agg_bezier_arc.h"
 
 using point_array = std::vector<pointf>;
+
+// builds the contents of a page. Pages may be built on different threads at once; each page takes
+// its place in the document when it is constructed (and after each showpage), so construct the
+// pages in order on one thread before handing them to the threads that draw them
 class pdf_page
 {
 	docpdf& m_doc;
@@ -24,15 +28,29 @@ class pdf_page
 	real_t m_page_height{ 0 };
 	int32_t m_page_rotation{ 0 };
 	error_type m_error_type{ error_type::none };
+	uint64_t m_sequence{ 0 }; // the place of the page in the document, if m_reserved
+	bool m_reserved{ false };
+	page_resources m_resources;
 
 	graphics_state m_gstate;
 
-	std::ostringstream m_stream;
+	content_stream m_content;
+	content_writer m_stream;
 
 	path_data m_path_data;
 	std::stack<graphics_state> m_graphics_stack;
 	std::stack<path_data> m_path_stack;
 	std::string m_error_message;
+	written_state m_written; // in effect at the end of the content stream
+	// the clip in effect in the content stream, 0 if none. It's written between q and Q when a paint
+	// operation first needs it, and stays in effect until the clip changes; see apply_clip()
+	uint64_t m_written_clip{ 0 };
+	written_state m_written_outside; // before the q of the clip
+	uint64_t m_clip_count{ 0 }; // the last clip id given; never reused, as a saved state may hold any
+	// the operator of the last path painted, while it hasn't been written yet: the paths painted after
+	// it the same way are added to it; see join_paint(). Null if written
+	const char* m_pending_op{ nullptr };
+	real_t m_pending_bounds[4]{ 0 }; // of the paths added to it
 private:
 	void save_path()
 	{
@@ -59,20 +77,173 @@ private:
 		if (char_codes)
 		{
 			font_record* font = m_gstate.font();
+			real_t font_size = m_gstate.font_size();
 
 			width = 0;
 
 			for (size_t i = 0; i < count; ++i)
 			{
-				real_t w = font->scaled_width(char_codes[i]);
+				real_t w = font->scaled_width(char_codes[i], font_size);
 
 				width += w;
 			}
 
-			height = font->height();
+			height = font->height(font_size);
 		}
 	}	
-	void prepare_graphics()
+	// makes the clip of the graphics state the one in effect in the content. A clip is written once,
+	// after a q, for all the operations that follow until it changes, e.g., at a grestore; the Q
+	// that ends it restores the parameters set before the q
+	void apply_clip()
+	{
+		uint64_t id = m_gstate.has_clip() ? m_gstate.m_clip_id : 0;
+
+		if (id == m_written_clip)
+		{
+			return;
+		}
+
+		end_clip();
+
+		if (id != 0)
+		{
+			m_written_outside = m_written;
+
+			m_stream << "q\n";
+
+			m_gstate.write_clip(m_stream);
+
+			m_written_clip = id;
+		}
+	}
+	void end_clip()
+	{
+		if (m_written_clip != 0)
+		{
+			m_stream << "Q\n";
+
+			m_written = m_written_outside;
+			m_written_clip = 0;
+		}
+	}
+	// writes the operator of the paths painted last; anything else written in the content must
+	// come after it
+	void flush_paint()
+	{
+		if (m_pending_op)
+		{
+			m_stream << m_pending_op << '\n';
+
+			m_pending_op = nullptr;
+		}
+	}
+	// adds the current path to the paths painted last if it's painted the same way: with the same
+	// operator, parameters and clip. The paths are then painted as a whole, so a filled path must
+	// not overlap them; e.g., with f* the overlap would become a hole. With B and B*, its fill must
+	// also stay clear of their strokes, which it would otherwise cover, so the boxes are compared
+	// with the strokes around them
+	bool join_paint(const char* op, bool do_fill, bool do_stroke, const matrix& ctm)
+	{
+		uint64_t clip = m_gstate.has_clip() ? m_gstate.m_clip_id : 0;
+		real_t box[4];
+		real_t margin = 0; // added to each side of both boxes
+		matrix mtx = ctm;
+
+		if (!m_pending_op || strcmp(op, m_pending_op) != 0 || clip != m_written_clip)
+		{
+			return false;
+		}
+		else if (do_stroke && !m_gstate.stroke_written(ctm, m_written))
+		{
+			return false;
+		}
+		else if (do_fill && !m_gstate.fill_written(m_written))
+		{
+			return false;
+		}
+
+		m_path_data.bounds(box);
+
+		if (do_fill && do_stroke)
+		{
+			// half the line width in the content; a miter join may reach the miter limit times as
+			// far, and the limit in effect is the default of 10, as it's never written
+			margin = m_written.m_linewidth / 2;
+
+			if (0 == m_gstate.m_linejoin)
+			{
+				margin *= 10;
+			}
+		}
+
+		if (do_fill && box[0] - margin < m_pending_bounds[2] + margin && m_pending_bounds[0] - margin < box[2] + margin
+			&& box[1] - margin < m_pending_bounds[3] + margin && m_pending_bounds[1] - margin < box[3] + margin)
+		{
+			return false;
+		}
+
+		m_path_data.write_path(m_stream, mtx);
+
+		m_pending_bounds[0] = (std::min)(m_pending_bounds[0], box[0]);
+		m_pending_bounds[1] = (std::min)(m_pending_bounds[1], box[1]);
+		m_pending_bounds[2] = (std::max)(m_pending_bounds[2], box[2]);
+		m_pending_bounds[3] = (std::max)(m_pending_bounds[3], box[3]);
+
+		return true;
+	}
+	// paints the current path with 'op'. The parameters already in effect in the content aren't
+	// written again. The operation is put between q and Q only if it has a transformation of its
+	// own; what it sets there is forgotten after the Q. Otherwise, the operator is written later,
+	// so that the paths painted the same way right after it share it
+	void paint(const char* op, bool do_fill, bool do_stroke)
+	{
+		matrix ctm = m_gstate.currentmatrix();
+
+		bool wrap = path_data::needs_transform(ctm);
+
+		if ((ctm.sx != 0 || ctm.sy != 0) && (wrap || !join_paint(op, do_fill, do_stroke, ctm)))
+		{
+			written_state inside;
+
+			flush_paint();
+
+			apply_clip();
+
+			if (wrap)
+			{
+				inside = m_written;
+
+				m_stream << "q\n";
+			}
+			if (do_fill)
+			{
+				m_gstate.on_fill(m_stream, wrap ? inside : m_written);
+			}
+			if (do_stroke)
+			{
+				m_gstate.on_stroke(m_stream, ctm, wrap ? inside : m_written);
+			}
+
+			if (wrap)
+			{
+				m_path_data.write(m_stream, op, ctm);
+
+				m_stream << "Q\n";
+			}
+			else
+			{
+				m_path_data.bounds(m_pending_bounds);
+
+				m_path_data.write_path(m_stream, ctm);
+
+				m_pending_op = op;
+			}
+		}
+		newpath();
+
+		m_error_type = error_type::none;
+	}
+	void prepare_graphics(written_state& written)
 	{
 		bool apply_stroke = false;
 		bool apply_fill = false;
@@ -105,33 +276,39 @@ private:
 
 		if (apply_stroke)
 		{
-			m_gstate.on_stroke(m_stream, m_gstate.currentmatrix());
+			m_gstate.on_stroke(m_stream, m_gstate.currentmatrix(), written);
 		}
 		if (apply_fill)
 		{
-			m_gstate.on_fill(m_stream);
+			m_gstate.on_fill(m_stream, written);
 		}
 	}
 	bool write_text(real_t x, real_t y, const byte_t* char_codes, size_t count)
 	{
 		pointf current_point{ 0, y };
 		font_record* font = m_gstate.font();
-		matrix font_ctm = font->transform();
+		matrix font_ctm = m_gstate.font_matrix();
 		real_t font_size = font_ctm.sy;
 		real_t total_width = 0;
 		matrix ctm = m_gstate.currentmatrix();
+		// the text state is set anew each time, so only a transformation needs q/Q
+		bool wrap = !ctm.is_identity();
+		written_state inside;
 
+		flush_paint();
 
-		m_stream << "q\n";
-
-		m_gstate.write_clip(m_stream);
+		apply_clip();
 
-		if (!ctm.is_identity())
+		if (wrap)
 		{
+			inside = m_written;
+
+			m_stream << "q\n";
+
 			m_stream << ctm << " cm\n";
 		}
 
-		prepare_graphics();
+		prepare_graphics(wrap ? inside : m_written);
 
 		m_stream << "BT\n";
 
@@ -144,7 +321,7 @@ private:
 
 		m_stream << "/F" << font->number() << " 1.0 Tf\n";
 
-		font->in_use(true);
+		m_resources.add_font_obj_number(font->number());
 
 		m_stream << '(';
 
@@ -152,7 +329,7 @@ private:
 		{
 			byte_t ch = char_codes[i];
 
-			real_t w = font->scaled_width(ch);
+			real_t w = font->scaled_width(ch, font_size);
 
 			total_width += w;
 
@@ -160,22 +337,29 @@ private:
 			{
 				if (ch != '(' && ch != ')')
 				{
-					m_stream << ch;
+					m_stream << (char)ch;
 				}
 				else
 				{
-					m_stream << '\\' << ch;
+					m_stream << '\\' << (char)ch;
 				}
 			}
 			else
 			{
-				m_stream << '\\' << std::setfill('0') << std::setw(3) << std::oct << (short)ch;
+				m_stream << '\\';
+
+				m_stream.octal(ch);
 			}
 		}
 
 		m_stream << ") Tj\n";
 
-		m_stream << "ET\nQ\n";
+		m_stream << "ET\n";
+
+		if (wrap)
+		{
+			m_stream << "Q\n";
+		}
 
 		current_point.x += total_width;
 
@@ -186,7 +370,7 @@ private:
 		return true;
 	}
 public:
-	pdf_page(docpdf& doc, real_t width, real_t height, int32_t rotation) : m_doc(doc), m_stream(), m_gstate(), 
+	pdf_page(docpdf& doc, real_t width, real_t height, int32_t rotation) : m_doc(doc), m_resources(), m_gstate(), m_content(), m_stream(m_content),
 							m_path_data(), m_graphics_stack(), m_path_stack(), m_error_message()
 	{
 		if (width <= 0)
@@ -211,23 +395,40 @@ public:
 			}
 			else
 			{
-				font->scale(11.0f);
 				m_gstate.font( font );
+				m_gstate.scalefont(11.0f);
 			}
 			m_page_width = width;
 			m_page_height = height;
 			m_page_rotation = rotation;
 
-			m_stream << std::fixed;
-			m_stream << std::setprecision(2);
+			m_content.begin(m_doc.content_level(), m_doc.compression());
 		}
 	}
 	~pdf_page()
 	{
-		if (m_stream.tellp() != std::streampos(0))
+		if (m_content.size() != 0)
 		{
 			showpage();
 		}
+		if (m_reserved)
+		{
+			m_doc.cancel_page(m_sequence);
+		}
+	}
+	// takes the place of the page in the document now. Otherwise, it's taken by showpage(), so the
+	// pages are written in the order they are shown. When the pages are drawn on several threads,
+	// call it on each page in the order of the document before the page is handed to its thread;
+	// the pages after a reserved one are held in memory until it's shown or destroyed.
+	// A page reserves again after showpage() for the next page drawn on it
+	void reserve()
+	{
+		if (!m_reserved)
+		{
+			m_sequence = m_doc.begin_page();
+
+			m_reserved = true;
+		}
 	}
 	real_t height() const
 	{
@@ -241,6 +442,11 @@ public:
 	{
 		return m_page_rotation;
 	}
+	// the number of decimals of the coordinates and the colors written to the page, 2 by default
+	void setprecision(int decimals)
+	{
+		m_stream.precision(decimals);
+	}
 	void erasepage()
 	{
 		gsave();
@@ -256,10 +462,17 @@ public:
 	}
 	void showpage()
 	{
-		m_doc.write_page(m_stream, m_page_width, m_page_height, m_page_rotation);
+		flush_paint();
+
+		end_clip();
+
+		reserve();
 
-		m_stream.str(std::string(""));
-		m_stream.clear();
+		m_doc.write_page(m_sequence, m_content, m_page_width, m_page_height, m_page_rotation, m_resources);
+
+		m_reserved = false;
+
+		m_written.reset();
 
 		m_path_data.newpath();
 
@@ -298,7 +511,7 @@ public:
 	{
 		if (size >= 0)
 		{
-			m_gstate.font()->scale(size);
+			m_gstate.scalefont(size);
 
 			m_error_type = error_type::none;
 
@@ -514,31 +727,31 @@ public:
 	{
 		m_error_type = error_type::none;
 
-		return m_gstate.font()->size();
+		return m_gstate.font_size();
 	}
 	real_t font_ascent() 
 	{
 		m_error_type = error_type::none;
 
-		return m_gstate.font()->ascent();
+		return m_gstate.font()->ascent(m_gstate.font_size());
 	}
 	real_t font_descent()
 	{
 		m_error_type = error_type::none;
 
-		return m_gstate.font()->descent();
+		return m_gstate.font()->descent(m_gstate.font_size());
 	}
 	real_t font_internal_leading()
 	{
 		m_error_type = error_type::none;
 
-		return m_gstate.font()->internal_leading();
+		return m_gstate.font()->internal_leading(m_gstate.font_size());
 	}
 	real_t font_external_leading()
 	{
 		m_error_type = error_type::none;
 
-		return m_gstate.font()->external_leading();
+		return m_gstate.font()->external_leading(m_gstate.font_size());
 	}
 	pointf angle_to_point(real_t angle, real_t cx, real_t cy, real_t radius, bool is_radian)
 	{
@@ -854,8 +1067,6 @@ private:
 
 			if (rectangle(x, y, width, height))
 			{
-				m_stream << "q\n";
-
 				if (do_stroke)
 				{
 					stroke();
@@ -864,7 +1075,6 @@ private:
 				{
 					fill();
 				}
-				m_stream << "Q\n";
 				m_error_type = error_type::none;
 			}
 			else
@@ -971,78 +1181,23 @@ public:
 	}
 	void stroke()
 	{
-		matrix ctm = m_gstate.currentmatrix();
-
-		if (ctm.sx != 0 || ctm.sy != 0)
-		{
-			m_stream << "q\n";
-			m_gstate.write_clip(m_stream);
-			m_gstate.on_stroke(m_stream, ctm);
-			m_path_data.write(m_stream, "S", ctm);
-			m_stream << "Q\n";
-		}
-		newpath();
-
-		m_error_type = error_type::none;
+		paint("S", false, true);
 	}
 	void fill()
 	{
-		matrix ctm = m_gstate.currentmatrix();
-
-		m_stream << "q\n";
-		m_gstate.write_clip(m_stream);
-		m_gstate.on_fill(m_stream);
-		m_path_data.write(m_stream, "f", ctm);
-		m_stream << "Q\n";
-		newpath();
-
-		m_error_type = error_type::none;
+		paint("f", true, false);
 	}
 	void eofill()
 	{
-		matrix ctm = m_gstate.currentmatrix();
-
-		m_stream << "q\n";
-		m_gstate.write_clip(m_stream);
-		m_gstate.on_fill(m_stream);
-		m_path_data.write(m_stream, "f*", ctm);
-		m_stream << "Q\n";
-		newpath();
-
-		m_error_type = error_type::none;
+		paint("f*", true, false);
 	}
 	void fill_and_stroke()
 	{
-		matrix ctm = m_gstate.currentmatrix();
-
-		if (ctm.sx != 0 || ctm.sy != 0)
-		{
-			m_stream << "q\n";
-			m_gstate.write_clip(m_stream);
-			m_gstate.on_fill(m_stream);
-			m_gstate.on_stroke(m_stream, ctm);
-			m_path_data.write(m_stream, "B", ctm);
-			m_stream << "Q\n";
-		}
-		newpath();
-
-		m_error_type = error_type::none;
+		paint("B", true, true);
 	}
 	void eofill_and_stroke()
 	{
-		matrix ctm = m_gstate.currentmatrix();
-
-		if (ctm.sx != 0 || ctm.sy != 0)
-		{
-			m_stream << "q\n";
-			m_gstate.on_fill(m_stream);
-			m_gstate.on_stroke(m_stream, ctm);
-			m_path_data.write(m_stream, "B*", ctm);
-			m_stream << "Q\n";
-		}
-		newpath();
-
-		m_error_type = error_type::none;
+		paint("B*", true, true);
 	}
 	void stringwidth(const byte_t* char_codes, size_t count, real_t& width, real_t& height)
 	{
@@ -1229,7 +1384,7 @@ public:
 					const byte_t* types = point_types.data();
 					const POINT* pts = points.data();
 					real_t emsquare = m_gstate.font()->m_em_square; //todo
-					matrix font_mtx = m_gstate.font()->m_matrix;	//todo
+					matrix font_mtx = m_gstate.font_matrix();
 					pointf curpoint = m_gstate.currentpoint();
 					matrix ctm = m_gstate.m_ctm;
 					pointf endpoint;
@@ -1321,19 +1476,25 @@ public:
 	}
 	bool image(const char* filename, real_t x, real_t y, real_t width, real_t height)
 	{
-		int32_t obj_number = m_doc.find_image(filename);
+		int32_t name = m_doc.find_image(filename);
 
-		if (obj_number != NOTFOUND)
+		if (name != NOTFOUND)
 		{
 			matrix mtx(width, 0, 0, height, x, y);
+
+			m_resources.add_image_name(name);
 			matrix ctm = m_gstate.currentmatrix();
 
+			flush_paint();
+
+			apply_clip();
+
 			m_stream << "q\n";
 
 			ctm.write(m_stream, "cm");
 			mtx.write(m_stream, "cm");
 
-			m_stream << "/Im" << obj_number << " Do\n";
+			m_stream << "/Im" << name << " Do\n";
 
 			m_stream << "Q\n";
 
@@ -1503,6 +1664,7 @@ public:
 		path_data& path = m_gstate.m_clipping_path;
 
 		m_gstate.m_clipping_path.rect(0, 0, m_page_width, m_page_height);
+		m_gstate.m_clip_id = ++m_clip_count;
 				
 		m_error_type = error_type::none;
 	}
@@ -1606,6 +1768,7 @@ public:
 		{			
 			m_gstate.m_clipping_path.append(m_path_data);
 		}
+		m_gstate.m_clip_id = ++m_clip_count;
 	}
 	void clip()
 	{
@@ -0,0 +1,419 @@
+/*
+//  Copyright (c) 2020 Peter Frane Jr. All Rights Reserved.
+//
+//  Use of this source code is governed by the BSD 3-Clause License that can be
+//  found in the LICENSE file.
+//
+//  This software is distributed on an "AS IS" basis, WITHOUT WARRANTY
+//  OF ANY KIND, either express or implied.
+//
+//  For inquiries, email the author at pfranejr AT hotmail.com
+*/
+
+#pragma once
+#include "types.h"
+#include "objects.hpp"
+#include "pdf_writer.hpp"
+
+
+// the fonts and the images used by a page, or by all the pages of a leaf node.
+// Each one has a name, e.g., /F5, and an object. The name stays the same in all the parts of a split
+// document, while the object differs from part to part; see docpdf::split_output().
+// A page uses only a few of them, so they are kept in small vectors sorted by name
+class page_resources
+{
+    using resource_list = std::vector<std::pair<int32_t, int32_t>>; // name, object number
+
+    resource_list m_font_list;
+    resource_list m_image_list;
+private:
+    static void insert(resource_list& list, int32_t name, int32_t object_number)
+    {
+        auto it = std::lower_bound(list.begin(), list.end(), name,
+            [](const std::pair<int32_t, int32_t>& item, int32_t value) { return item.first < value; });
+
+        if (it == list.end() || it->first != name)
+        {
+            try
+            {
+                list.emplace(it, name, object_number);
+            }
+            catch (...)
+            {
+                throw std::runtime_error("Out of memory");
+            }
+        }
+    }
+    static void insert(resource_list& list, const resource_list& other)
+    {
+        for (const auto& i : other)
+        {
+            insert(list, i.first, i.second);
+        }
+    }
+    static void write_list(pdf_writer& out, const char* type, const char* prefix, const resource_list& list)
+    {
+        out.put(type).put(" <<\n");
+
+        for (const auto& i : list)
+        {
+            if (i.second != 0)
+            {
+                out.put('\t').put(prefix).put_int(i.first).put(' ').put_ref(i.second).put('\n');
+            }
+        }
+        out.put("\t>>\n");
+    }
+public:
+    page_resources() : m_font_list(), m_image_list()
+    {
+    }
+    void clear()
+    {
+        m_font_list.clear();
+        m_image_list.clear();
+    }
+    bool empty() const
+    {
+        return m_font_list.empty() && m_image_list.empty();
+    }
+    // the name of a font is the number of the object first written for it
+    void add_font_obj_number(int32_t m_number)
+    {
+        insert(m_font_list, m_number, m_number);
+    }
+    // an image is named by the image manager; its object is set when the page is written
+    void add_image_name(int32_t name)
+    {
+        insert(m_image_list, name, 0);
+    }
+    // a resource whose object is already known, e.g., one copied from a merged file
+    void add_font(int32_t name, int32_t object_number)
+    {
+        insert(m_font_list, name, object_number);
+    }
+    void add_image(int32_t name, int32_t object_number)
+    {
+        insert(m_image_list, name, object_number);
+    }
+    // adds the fonts and the images of another page
+    void add(const page_resources& other)
+    {
+        insert(m_font_list, other.m_font_list);
+        insert(m_image_list, other.m_image_list);
+    }
+    // calls 'function' with the name of each image
+    template<typename function>
+    void for_each_image(function image_function) const
+    {
+        for (const auto& i : m_image_list)
+        {
+            image_function(i.first);
+        }
+    }
+    // sets the objects of the resources in the file being written: 'font_object' and 'image_object'
+    // take the name and return the object number, or 0 if the resource can't be written
+    template<typename font_function, typename image_function>
+    void set_objects(font_function font_object, image_function image_object)
+    {
+        for (auto& i : m_font_list)
+        {
+            i.second = font_object(i.first);
+        }
+        for (auto& i : m_image_list)
+        {
+            i.second = image_object(i.first);
+        }
+    }
+    bool operator<(const page_resources& other) const
+    {
+        if (m_font_list != other.m_font_list)
+        {
+            return m_font_list < other.m_font_list;
+        }
+        return m_image_list < other.m_image_list;
+    }
+    // the resource dictionary
+    void write(pdf_writer& out) const
+    {
+        out.put("<<\n");
+
+        if (!m_font_list.empty())
+        {
+            write_list(out, "/Font", "/F", m_font_list);
+        }
+        if (!m_image_list.empty())
+        {
+            write_list(out, "/XObject", "/Im", m_image_list);
+        }
+        out.put(">>\n");
+    }
+};
+
+// the inheritable page attributes; the pages of a leaf node share them
+struct page_attributes
+{
+    real_t m_width{ 0 };
+    real_t m_height{ 0 };
+    int32_t m_rotation{ 0 };
+    // the pages of different merged files use the same resource names for different objects,
+    // so they never share a leaf node; 0 for the pages built by the document
+    int32_t m_group{ 0 };
+
+    bool operator==(const page_attributes& other) const
+    {
+        return m_width == other.m_width && m_height == other.m_height && m_rotation == other.m_rotation && m_group == other.m_group;
+    }
+    bool operator!=(const page_attributes& other) const
+    {
+        return !(*this == other);
+    }
+};
+
+// builds a balanced tree of /Pages nodes as the pages are written.
+// only the node being filled at each level is kept in memory; a node is written as soon as it's
+// full, and its parent is allocated at that time. The MediaBox, the Rotate and the Resources
+// of the pages are written once in their leaf node instead of in every page, and the leaves
+// with the same resources refer to a single resource dictionary
+class page_tree
+{
+    static const size_t max_kids = 32;
+
+    struct node
+    {
+        object_record* m_obj{ nullptr }; // null if the level has no open node
+        int_vector m_kids;
+        int64_t m_count{ 0 }; // the number of pages below this node
+    };
+
+    std::vector<node> m_levels; // level 0 holds the leaf node
+    page_attributes m_attributes; // of the leaf node
+    page_resources m_resources; // all the resources used by the pages of the leaf node
+    std::map<page_resources, int32_t> m_resource_dicts; // the resource dictionaries written so far
+private:
+    // the resources of the leaf node as an indirect object; it's written the first time they are used
+    int32_t resource_dict(object_list& objects, pdf_writer& out)
+    {
+        auto it = m_resource_dicts.find(m_resources);
+        object_record* obj;
+
+        if (it != m_resource_dicts.end())
+        {
+            return it->second;
+        }
+
+        obj = objects.next_object();
+
+        try
+        {
+            m_resource_dicts.emplace(m_resources, obj->m_number);
+        }
+        catch (...)
+        {
+            throw std::runtime_error("Out of memory");
+        }
+
+        m_resources.write(objects.begin_object(obj, out));
+
+        objects.end_object(out);
+
+        return obj->m_number;
+    }
+    // opens a node at the given level
+    void open_node(size_t level, object_list& objects)
+    {
+        try
+        {
+            if (level >= m_levels.size())
+            {
+                m_levels.resize(level + 1);
+            }
+            m_levels[level].m_kids.reserve(max_kids);
+        }
+        catch (...)
+        {
+            throw std::runtime_error("Out of memory");
+        }
+
+        m_levels[level].m_obj = objects.next_object();
+    }
+    // true if there is an open node above the level
+    bool has_parent(size_t level) const
+    {
+        for (size_t i = level + 1; i < m_levels.size(); ++i)
+        {
+            if (m_levels[i].m_obj)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    // writes the node at the given level; it becomes the root if 'root' is true
+    void close_node(size_t level, bool root, object_list& objects, pdf_writer& out)
+    {
+        int32_t parent = 0;
+
+        if (!root)
+        {
+            if (level + 1 < m_levels.size() && m_levels[level + 1].m_obj && m_levels[level + 1].m_kids.size() >= max_kids)
+            {
+                close_node(level + 1, false, objects, out);
+            }
+            if (level + 1 == m_levels.size() || !m_levels[level + 1].m_obj)
+            {
+                open_node(level + 1, objects);
+            }
+
+            {
+                node& up = m_levels[level + 1];
+
+                up.m_kids.push_back(m_levels[level].m_obj->m_number);
+                up.m_count += m_levels[level].m_count;
+
+                parent = up.m_obj->m_number;
+            }
+        }
+
+        {
+            node& current = m_levels[level];
+            int32_t resources = (0 == level && !m_resources.empty()) ? resource_dict(objects, out) : 0;
+            pdf_dictionary dict(objects.begin_object(current.m_obj, out));
+
+            dict.name("/Type", "/Pages");
+
+            if (parent != 0)
+            {
+                dict.ref("/Parent", parent);
+            }
+
+            dict.integer("/Count", current.m_count).refs("/Kids", current.m_kids);
+
+            if (0 == level && current.m_count > 0)
+            {
+                const double media_box[] = { 0, 0, m_attributes.m_width, m_attributes.m_height };
+
+                dict.reals("/MediaBox", media_box, 4);
+
+                if (m_attributes.m_rotation != 0)
+                {
+                    dict.integer("/Rotate", m_attributes.m_rotation);
+                }
+
+                if (resources != 0)
+                {
+                    dict.ref("/Resources", resources);
+                }
+                else
+                {
+                    dict.value("/Resources").put("<<>>\n");
+                }
+
+                m_resources.clear();
+            }
+
+            dict.end();
+
+            objects.end_object(out);
+
+            current.m_obj = nullptr;
+            current.m_kids.clear();
+            current.m_count = 0;
+        }
+    }
+public:
+    page_tree() : m_levels(), m_attributes(), m_resources()
+    {
+    }
+    void clear()
+    {
+        m_levels.clear();
+        m_resources.clear();
+        m_resource_dicts.clear();
+    }
+    // allocates the object of a new page; its /Parent is parent() and it inherits
+    // the attributes and the resources from there
+    object_record* add_page(const page_attributes& attributes, const page_resources& resources, object_list& objects, pdf_writer& out)
+    {
+        object_record* page;
+
+        if (!m_levels.empty() && m_levels[0].m_obj && (m_levels[0].m_kids.size() >= max_kids || m_attributes != attributes))
+        {
+            close_node(0, false, objects, out);
+        }
+        if (m_levels.empty() || !m_levels[0].m_obj)
+        {
+            open_node(0, objects);
+
+            m_attributes = attributes;
+        }
+
+        page = objects.next_object();
+
+        try
+        {
+            m_levels[0].m_kids.push_back(page->m_number);
+            m_levels[0].m_count++;
+
+            m_resources.add(resources);
+        }
+        catch (...)
+        {
+            throw std::runtime_error("Out of memory");
+        }
+
+        return page;
+    }
+    // continues the page tree of a file being appended to: its root becomes the first kid of a new
+    // node, whose object number is returned. The old root must be written again with this /Parent
+    int32_t append_to(int32_t root, int64_t page_count, object_list& objects)
+    {
+        open_node(1, objects);
+
+        try
+        {
+            m_levels[1].m_kids.push_back(root);
+        }
+        catch (...)
+        {
+            throw std::runtime_error("Out of memory");
+        }
+
+        m_levels[1].m_count = page_count;
+
+        return m_levels[1].m_obj->m_number;
+    }
+    // the leaf node of the last page added
+    int32_t parent() const
+    {
+        return m_levels[0].m_obj->m_number;
+    }
+    // writes the nodes still open; returns the object number of the root node
+    int32_t finish(object_list& objects, pdf_writer& out)
+    {
+        if (m_levels.empty())
+        {
+            // no pages
+            open_node(0, objects);
+        }
+
+        for (size_t i = 0; i < m_levels.size(); ++i)
+        {
+            if (m_levels[i].m_obj)
+            {
+                if (!has_parent(i))
+                {
+                    int32_t root = m_levels[i].m_obj->m_number;
+
+                    close_node(i, true, objects, out);
+
+                    m_levels.clear();
+
+                    return root;
+                }
+                close_node(i, false, objects, out);
+            }
+        }
+        return 0;
+    }
+};
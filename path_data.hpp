@@ -14,6 +14,7 @@
 
 #include "types.h"
 #include "matrix.hpp"
+#include <limits>
 
 struct point_data
 {
@@ -279,7 +280,61 @@ public:
 			}
 		}
 	}
-	void write(std::ostringstream& stream, std::string command, matrix &ctm)
+	// true if write() sets a transformation of its own: the points are in device space, and a
+	// scale that differs in x and y is kept so the line width follows it
+	static bool needs_transform(const matrix& ctm)
+	{
+		return ctm.sx != ctm.sy;
+	}
+	// the smallest box around the segments of the path, as left, bottom, right and top; the control
+	// points of the curves are included. A moveto that no segment follows adds nothing; if there
+	// are no segments, the box is empty: its left is greater than its right
+	void bounds(real_t box[4]) const
+	{
+		const point_data* start = nullptr; // the moveto of the current subpath until a segment follows
+		size_t count = m_data.size();
+
+		box[0] = box[1] = (std::numeric_limits<real_t>::max)();
+		box[2] = box[3] = -(std::numeric_limits<real_t>::max)();
+
+		auto add = [box](real_t x, real_t y)
+		{
+			box[0] = (std::min)(box[0], x);
+			box[1] = (std::min)(box[1], y);
+			box[2] = (std::max)(box[2], x);
+			box[3] = (std::max)(box[3], y);
+		};
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			const point_data& d = m_data[i];
+
+			if (pt_moveto == d.type)
+			{
+				start = &d;
+			}
+			else if (pt_rect == d.type)
+			{
+				// the corner, then the width and the height
+				add(d.x, d.y);
+				add(d.x + m_data[i + 1].x, d.y + m_data[i + 1].y);
+
+				i++;
+			}
+			else
+			{
+				if (start)
+				{
+					add(start->x, start->y);
+
+					start = nullptr;
+				}
+				add(d.x, d.y);
+			}
+		}
+	}
+	// writes the segments of the path, but not the operator that paints it
+	void write_path(content_writer& stream, matrix& ctm)
 	{
 		if (ctm.sx == 0 && ctm.sy == 0)
 		{
@@ -299,11 +354,12 @@ public:
 			ctm.rx = ctm.ry = ctm.tx = ctm.ty = 0;
 
 
-			stream << ctm << " cm\n";
-				
-			stream << std::fixed;
+			if (ctm.sx != 1 || ctm.sy != 1)
+			{
+				stream << ctm << " cm\n";
 
-			rescale(ctm.sx, ctm.sy, count, data);
+				rescale(ctm.sx, ctm.sy, count, data);
+			}
 
 			for (size_t i = 0; i < count; ++i)
 			{
@@ -353,17 +409,24 @@ public:
 					break;
 				}
 			}
-
-			stream << command << '\n';
 		}
 	}
-	void write_clip(std::ostringstream& stream, std::string command)
+	void write(content_writer& stream, std::string command, matrix &ctm)
+	{
+		if (ctm.sx == 0 && ctm.sy == 0)
+		{
+			return;
+		}
+
+		write_path(stream, ctm);
+
+		stream << command << '\n';
+	}
+	void write_clip(content_writer& stream, std::string command)
 	{
 			size_t count = m_data.size();
 			point_data* data = m_data.data();
 
-	
-			stream << std::fixed;
 
 			for (size_t i = 0; i < count; ++i)
 			{
@@ -0,0 +1,1008 @@
+/*
+//  Copyright (c) 2020 Peter Frane Jr. All Rights Reserved.
+//
+//  Use of this source code is governed by the BSD 3-Clause License that can be
+//  found in the LICENSE file.
+//
+//  This software is distributed on an "AS IS" basis, WITHOUT WARRANTY
+//  OF ANY KIND, either express or implied.
+//
+//  For inquiries, email the author at pfranejr AT hotmail.com
+*/
+
+#pragma once
+#include "types.h"
+#include <zlib.h>
+
+// reads the trailer and single objects of a file written by this library, so that
+// an incremental update can be appended to it, or its pages merged into another document.
+// This is not a general PDF parser: only the objects that are asked for are read, through
+// the cross-reference sections
+class pdf_reader
+{
+    struct xref_entry
+    {
+        int m_type{ -1 }; // -1 until the entry is read
+        int64_t m_field2{ 0 };
+        int64_t m_field3{ 0 };
+    };
+
+    FILE* m_fp{ nullptr };
+    int64_t m_startxref{ 0 };
+    int32_t m_size{ 0 };
+    int32_t m_root{ 0 };
+    bool m_xref_stream{ false }; // the last section is a cross-reference stream
+    bool m_pdf15{ false }; // the header says 1.5 or later
+    std::vector<xref_entry> m_entries; // all the entries; see load_xref()
+    // the object stream read last; the objects in it are usually read one after another
+    int32_t m_objstm_number{ 0 };
+    std::string m_objstm_dict;
+    std::string m_objstm_data;
+private:
+    bool seek(int64_t offset)
+    {
+#ifdef _WIN32
+        return 0 == _fseeki64(m_fp, offset, SEEK_SET);
+#else
+        return 0 == fseeko(m_fp, (off_t)offset, SEEK_SET);
+#endif
+    }
+    int64_t tell()
+    {
+#ifdef _WIN32
+        return _ftelli64(m_fp);
+#else
+        return (int64_t)ftello(m_fp);
+#endif
+    }
+    // reads up to 'size' bytes; fewer at the end of the file
+    bool read_at(int64_t offset, size_t size, std::string& data)
+    {
+        data.resize(size);
+
+        if (!seek(offset))
+        {
+            return false;
+        }
+
+        data.resize(std::fread(&data[0], 1, size, m_fp));
+
+        return !data.empty();
+    }
+    static bool is_delimiter(char ch)
+    {
+        return isspace((byte_t)ch) || strchr("/<>[](){}%", ch) != nullptr;
+    }
+    static size_t skip_space(const std::string& str, size_t pos)
+    {
+        while (pos < str.size() && isspace((byte_t)str[pos]))
+        {
+            ++pos;
+        }
+        return pos;
+    }
+    static size_t skip_digits(const std::string& str, size_t pos)
+    {
+        while (pos < str.size() && isdigit((byte_t)str[pos]))
+        {
+            ++pos;
+        }
+        return pos;
+    }
+    // the position after the value of 'key', e.g., "/Size"; std::string::npos if not found
+    static size_t find_key(const std::string& dict, const char* key)
+    {
+        size_t length = strlen(key);
+        size_t pos = dict.find(key);
+
+        while (pos != std::string::npos)
+        {
+            if (pos + length < dict.size() && is_delimiter(dict[pos + length]))
+            {
+                return skip_space(dict, pos + length);
+            }
+            pos = dict.find(key, pos + length);
+        }
+        return std::string::npos;
+    }
+    static bool read_int(const std::string& str, size_t& pos, int64_t& value)
+    {
+        size_t start;
+
+        pos = skip_space(str, pos);
+        start = pos;
+
+        value = 0;
+
+        while (pos < str.size() && isdigit((byte_t)str[pos]))
+        {
+            value = value * 10 + (str[pos++] - '0');
+        }
+        return pos > start;
+    }
+    static bool get_int_array(const std::string& dict, const char* key, std::vector<int64_t>& values)
+    {
+        size_t pos = find_key(dict, key);
+        int64_t value;
+
+        values.clear();
+
+        if (pos == std::string::npos || dict[pos] != '[')
+        {
+            return false;
+        }
+
+        ++pos;
+
+        while (read_int(dict, pos, value))
+        {
+            values.push_back(value);
+        }
+        return true;
+    }
+    // the dictionary starting at 'pos', including the nested ones
+    static bool extract_dictionary(const std::string& str, size_t pos, std::string& dict)
+    {
+        size_t start;
+        int depth = 0;
+
+        pos = skip_space(str, pos);
+        start = pos;
+
+        while (pos + 1 < str.size())
+        {
+            if ('<' == str[pos] && '<' == str[pos + 1])
+            {
+                ++depth;
+                pos += 2;
+            }
+            else if ('>' == str[pos] && '>' == str[pos + 1])
+            {
+                pos += 2;
+
+                if (0 == --depth)
+                {
+                    dict.assign(str, start, pos - start);
+
+                    return true;
+                }
+            }
+            else if (0 == depth)
+            {
+                return false;
+            }
+            else
+            {
+                ++pos;
+            }
+        }
+        return false;
+    }
+    static bool inflate_data(const std::string& source, std::string& dest)
+    {
+        z_stream stream;
+        char buffer[16384];
+        int ret;
+
+        std::memset(&stream, 0, sizeof(stream));
+
+        if (inflateInit(&stream) != Z_OK)
+        {
+            return false;
+        }
+
+        stream.next_in = (Bytef*)source.data();
+        stream.avail_in = (uInt)source.size();
+
+        dest.clear();
+
+        do
+        {
+            stream.next_out = (Bytef*)buffer;
+            stream.avail_out = sizeof(buffer);
+
+            ret = inflate(&stream, Z_NO_FLUSH);
+
+            if (ret != Z_OK && ret != Z_STREAM_END)
+            {
+                break;
+            }
+            dest.append(buffer, sizeof(buffer) - stream.avail_out);
+
+        } while (ret != Z_STREAM_END);
+
+        inflateEnd(&stream);
+
+        return Z_STREAM_END == ret;
+    }
+    // the object at 'offset'; 'stream' receives the decoded stream data, if asked for.
+    // If 'is_stream' isn't null, the object need not have a stream, and the data is left as it's
+    // stored in the file. A 'number' of 0 accepts any object
+    bool read_object_at(int64_t offset, int32_t number, std::string& dict, std::string* stream, bool* is_stream = nullptr)
+    {
+        std::string data;
+        size_t pos = 0;
+        int64_t value, generation;
+
+        if (!read_at(offset, 4096, data) || !read_int(data, pos, value) || !read_int(data, pos, generation))
+        {
+            return false;
+        }
+        else if ((number != 0 && value != number) || data.compare(skip_space(data, pos), 3, "obj") != 0)
+        {
+            return false;
+        }
+
+        pos = skip_space(data, pos) + 3;
+
+        while (!extract_dictionary(data, pos, dict))
+        {
+            // a dictionary bigger than the block read
+            std::string more;
+
+            if (data.size() > 16 * 1024 * 1024 || !read_at(offset + (int64_t)data.size(), data.size(), more))
+            {
+                return false;
+            }
+            data += more;
+        }
+
+        if (stream)
+        {
+            int64_t length;
+            std::string encoded;
+
+            pos = skip_space(data, data.find(dict, pos) + dict.size());
+
+            if (is_stream)
+            {
+                *is_stream = data.compare(pos, 6, "stream") == 0;
+
+                if (!*is_stream)
+                {
+                    stream->clear();
+
+                    return true;
+                }
+            }
+
+            if (data.compare(pos, 6, "stream") != 0 || !get_int(dict, "/Length", length))
+            {
+                return false;
+            }
+
+            pos += 6;
+
+            if (pos < data.size() && '\r' == data[pos])
+            {
+                ++pos;
+            }
+            if (pos < data.size() && '\n' == data[pos])
+            {
+                ++pos;
+            }
+
+            if (!read_at(offset + (int64_t)pos, (size_t)length, encoded) || encoded.size() != (size_t)length)
+            {
+                return false;
+            }
+
+            if (!is_stream && find_key(dict, "/Filter") != std::string::npos)
+            {
+                return inflate_data(encoded, *stream);
+            }
+
+            stream->swap(encoded);
+        }
+        return true;
+    }
+    // undoes the PNG predictors None, Sub and Up, which this library writes
+    static bool unpredict(std::string& data, int64_t columns)
+    {
+        size_t row_width = (size_t)columns + 1;
+        size_t rows = data.size() / row_width;
+        std::string previous((size_t)columns, '\0');
+        std::string result;
+
+        if (columns <= 0 || data.size() % row_width != 0)
+        {
+            return false;
+        }
+
+        result.reserve(rows * (size_t)columns);
+
+        for (size_t i = 0; i < rows; ++i)
+        {
+            const char* row = data.data() + i * row_width;
+            std::string current(row + 1, (size_t)columns);
+
+            for (size_t j = 0; j < (size_t)columns; ++j)
+            {
+                switch (row[0])
+                {
+                case 0:
+                    break;
+                case 1:
+                    current[j] = (char)(current[j] + ((j > 0) ? current[j - 1] : 0));
+                    break;
+                case 2:
+                    current[j] = (char)(current[j] + previous[j]);
+                    break;
+                default:
+                    return false;
+                }
+            }
+            result += current;
+            previous.swap(current);
+        }
+        data.swap(result);
+
+        return true;
+    }
+    // calls fn(number, type, field2, field3) for the entries of the cross-reference stream at 'offset'
+    // until it returns false
+    template<typename function>
+    bool read_xref_stream(int64_t offset, function fn, int64_t& prev)
+    {
+        std::string dict, data;
+        std::vector<int64_t> widths, index;
+        int64_t size, predictor = 0, columns;
+        size_t row_width, row = 0;
+
+        prev = 0;
+
+        if (!read_object_at(offset, 0, dict, &data) || !get_int_array(dict, "/W", widths) || widths.size() != 3 || !get_int(dict, "/Size", size))
+        {
+            return false;
+        }
+
+        get_int(dict, "/Prev", prev);
+
+        if (get_int(dict, "/Predictor", predictor) && predictor >= 10 && (!get_int(dict, "/Columns", columns) || !unpredict(data, columns)))
+        {
+            return false;
+        }
+
+        if (!get_int_array(dict, "/Index", index) || index.empty())
+        {
+            index.assign({ 0, size });
+        }
+
+        row_width = (size_t)(widths[0] + widths[1] + widths[2]);
+
+        for (size_t i = 0; i + 1 < index.size(); i += 2)
+        {
+            for (int64_t j = 0; j < index[i + 1]; ++j, ++row)
+            {
+                const byte_t* p;
+                int64_t fields[3];
+
+                if ((row + 1) * row_width > data.size())
+                {
+                    return false;
+                }
+
+                p = (const byte_t*)data.data() + row * row_width;
+
+                for (int k = 0; k < 3; ++k)
+                {
+                    fields[k] = 0;
+
+                    for (int64_t n = 0; n < widths[k]; ++n)
+                    {
+                        fields[k] = (fields[k] << 8) | *p++;
+                    }
+                }
+
+                // the type defaults to 1 if its width is 0
+                if (!fn((int32_t)(index[i] + j), (0 == widths[0]) ? 1 : (int)fields[0], fields[1], fields[2]))
+                {
+                    return true;
+                }
+            }
+        }
+        return true;
+    }
+    // looks up the entry of an object in the cross-reference stream at 'offset'
+    bool find_in_xref_stream(int64_t offset, int32_t number, int& type, int64_t& field2, int64_t& field3, int64_t& prev)
+    {
+        type = -1; // not in this section
+
+        return read_xref_stream(offset, [&](int32_t entry_number, int entry_type, int64_t entry_field2, int64_t entry_field3)
+            {
+                if (entry_number != number)
+                {
+                    return true;
+                }
+
+                type = entry_type;
+                field2 = entry_field2;
+                field3 = entry_field3;
+
+                return false;
+            }, prev);
+    }
+    // looks up the entry of an object in the xref table at 'offset'; 'trailer' receives the trailer dictionary
+    bool find_in_xref_table(int64_t offset, int32_t number, int& type, int64_t& field2, int64_t& field3, std::string& trailer)
+    {
+        char line[64];
+
+        type = -1;
+
+        if (!seek(offset) || !std::fgets(line, sizeof(line), m_fp) || strncmp(line, "xref", 4) != 0)
+        {
+            return false;
+        }
+
+        while (std::fgets(line, sizeof(line), m_fp))
+        {
+            std::string str(line);
+            size_t pos = 0;
+            int64_t start, count;
+
+            if (0 == str.compare(0, 7, "trailer"))
+            {
+                std::string data;
+
+                return read_at(tell() - (int64_t)str.size() + 7, 4096, data) && extract_dictionary(data, 0, trailer);
+            }
+            else if (!read_int(str, pos, start) || !read_int(str, pos, count))
+            {
+                return false;
+            }
+            else if (-1 == type && number >= start && number < start + count)
+            {
+                // the entries are 20 bytes each
+                char entry[21]{ 0 };
+                int64_t here = tell();
+
+                if (!seek(here + (number - start) * 20) || std::fread(entry, 1, 20, m_fp) != 20)
+                {
+                    return false;
+                }
+
+                field2 = atoll(entry);
+                field3 = atoll(entry + 11);
+                type = ('n' == entry[17]) ? 1 : 0;
+
+                // read the remaining subsections for the trailer
+                seek(here);
+            }
+
+            if (!seek(tell() + count * 20))
+            {
+                return false;
+            }
+        }
+        return false;
+    }
+    // keeps an entry read by load_xref() unless a newer section had it
+    void set_entry(int64_t number, int type, int64_t field2, int64_t field3)
+    {
+        if (number >= 0 && number < (int64_t)m_entries.size() && -1 == m_entries[(size_t)number].m_type)
+        {
+            xref_entry& entry = m_entries[(size_t)number];
+
+            entry.m_type = type;
+            entry.m_field2 = field2;
+            entry.m_field3 = field3;
+        }
+    }
+    // reads all the entries of the xref table at 'offset'; 'trailer' receives the trailer dictionary
+    bool load_xref_table(int64_t offset, std::string& trailer)
+    {
+        char line[64];
+
+        if (!seek(offset) || !std::fgets(line, sizeof(line), m_fp) || strncmp(line, "xref", 4) != 0)
+        {
+            return false;
+        }
+
+        while (std::fgets(line, sizeof(line), m_fp))
+        {
+            std::string str(line);
+            size_t pos = 0;
+            int64_t start, count;
+
+            if (0 == str.compare(0, 7, "trailer"))
+            {
+                std::string data;
+
+                return read_at(tell() - (int64_t)str.size() + 7, 4096, data) && extract_dictionary(data, 0, trailer);
+            }
+            else if (!read_int(str, pos, start) || !read_int(str, pos, count))
+            {
+                return false;
+            }
+
+            for (int64_t i = 0; i < count; ++i)
+            {
+                char entry[21]{ 0 };
+
+                if (std::fread(entry, 1, 20, m_fp) != 20)
+                {
+                    return false;
+                }
+
+                set_entry(start + i, ('n' == entry[17]) ? 1 : 0, atoll(entry), atoll(entry + 11));
+            }
+        }
+        return false;
+    }
+    // the newest entry of an object; type 0: free, 1: at offset 'field2', 2: in object stream 'field2' at index 'field3'
+    bool find_entry(int32_t number, int& type, int64_t& field2, int64_t& field3)
+    {
+        int64_t offset = m_startxref;
+        std::string keyword;
+
+        if (!m_entries.empty())
+        {
+            if (number < 0 || (size_t)number >= m_entries.size())
+            {
+                return false;
+            }
+
+            type = m_entries[(size_t)number].m_type;
+            field2 = m_entries[(size_t)number].m_field2;
+            field3 = m_entries[(size_t)number].m_field3;
+
+            return type != -1;
+        }
+
+        // each update has its own section, linked by /Prev; stop at a loop
+        for (int sections = 0; offset > 0 && sections < 10000; ++sections)
+        {
+            int64_t prev = 0;
+
+            if (!read_at(offset, 4, keyword))
+            {
+                return false;
+            }
+            else if ("xref" == keyword)
+            {
+                std::string trailer;
+
+                if (!find_in_xref_table(offset, number, type, field2, field3, trailer))
+                {
+                    return false;
+                }
+                get_int(trailer, "/Prev", prev);
+            }
+            else if (!find_in_xref_stream(offset, number, type, field2, field3, prev))
+            {
+                return false;
+            }
+
+            if (type != -1)
+            {
+                return true;
+            }
+            offset = prev;
+        }
+        return false;
+    }
+public:
+    pdf_reader() = default;
+    pdf_reader(const pdf_reader&) = delete;
+    pdf_reader& operator=(const pdf_reader&) = delete;
+    ~pdf_reader()
+    {
+        close();
+    }
+    bool open(const char* filename)
+    {
+        close();
+
+        fopen_s(&m_fp, filename, "rb");
+
+        return m_fp != nullptr;
+    }
+    void close()
+    {
+        if (m_fp)
+        {
+            std::fclose(m_fp);
+
+            m_fp = nullptr;
+        }
+
+        m_entries.clear();
+        m_objstm_number = 0;
+        m_objstm_dict.clear();
+        m_objstm_data.clear();
+    }
+    // reads the header and the last trailer
+    bool read_trailer()
+    {
+        std::string data, dict;
+        int64_t file_size, value, field2, field3;
+        size_t pos;
+        int type;
+
+        if (!read_at(0, 8, data) || data.compare(0, 5, "%PDF-") != 0)
+        {
+            return false;
+        }
+
+        m_pdf15 = data.compare(5, 3, "1.5") >= 0;
+
+        if (!seek(0) || std::fseek(m_fp, 0, SEEK_END) != 0 || (file_size = tell()) <= 0)
+        {
+            return false;
+        }
+
+        read_at((std::max)(file_size - 1024, (int64_t)0), 1024, data);
+
+        pos = data.rfind("startxref");
+
+        if (std::string::npos == pos)
+        {
+            return false;
+        }
+
+        pos += 9;
+
+        if (!read_int(data, pos, m_startxref) || !read_at(m_startxref, 4, data))
+        {
+            return false;
+        }
+
+        m_xref_stream = (data != "xref");
+
+        if (m_xref_stream ? !read_object_at(m_startxref, 0, dict, nullptr) : !find_in_xref_table(m_startxref, -1, type, field2, field3, dict))
+        {
+            return false;
+        }
+
+        if (!get_int(dict, "/Size", value) || !get_ref(dict, "/Root", m_root))
+        {
+            return false;
+        }
+
+        m_size = (int32_t)value;
+
+        return true;
+    }
+    int64_t startxref() const
+    {
+        return m_startxref;
+    }
+    int32_t size() const
+    {
+        return m_size;
+    }
+    int32_t root() const
+    {
+        return m_root;
+    }
+    bool xref_stream() const
+    {
+        return m_xref_stream;
+    }
+    bool pdf15() const
+    {
+        return m_pdf15;
+    }
+    // the dictionary of an object that has no stream, e.g., the catalog or a page tree node
+    bool read_object(int32_t number, std::string& dict)
+    {
+        int type;
+        int64_t field2, field3;
+
+        if (!find_entry(number, type, field2, field3))
+        {
+            return false;
+        }
+        else if (1 == type)
+        {
+            return read_object_at(field2, number, dict, nullptr);
+        }
+        else if (2 == type)
+        {
+            // in an object stream: the header holds pairs of object numbers and offsets
+            int64_t stream_offset, first, value, offset, next = -1;
+            int type2, count;
+            const std::string& data = m_objstm_data;
+            size_t pos = 0;
+
+            if (m_objstm_number != field2)
+            {
+                m_objstm_number = 0;
+
+                if (!find_entry((int32_t)field2, type2, stream_offset, value) || type2 != 1
+                    || !read_object_at(stream_offset, (int32_t)field2, m_objstm_dict, &m_objstm_data))
+                {
+                    return false;
+                }
+
+                m_objstm_number = (int32_t)field2;
+            }
+
+            if (!get_int(m_objstm_dict, "/First", first) || !get_int(m_objstm_dict, "/N", value))
+            {
+                return false;
+            }
+
+            count = (int)value;
+
+            for (int i = 0; i <= field3 && i < count; ++i)
+            {
+                if (!read_int(data, pos, value) || !read_int(data, pos, offset))
+                {
+                    return false;
+                }
+            }
+            if (value != number)
+            {
+                return false;
+            }
+            if (field3 + 1 < count && read_int(data, pos, value))
+            {
+                read_int(data, pos, next);
+            }
+
+            if ((size_t)(first + offset) > data.size())
+            {
+                return false;
+            }
+
+            return extract_dictionary(data.substr((size_t)(first + offset), (next < 0) ? std::string::npos : (size_t)(next - offset)), 0, dict);
+        }
+        return false;
+    }
+    // any object, for copying it to another file: 'data' receives its stream as it's stored in the file,
+    // still compressed, or is cleared if the object has no stream
+    bool read_raw_object(int32_t number, std::string& dict, std::string& data, bool& is_stream)
+    {
+        int type;
+        int64_t field2, field3;
+
+        if (!find_entry(number, type, field2, field3))
+        {
+            return false;
+        }
+        else if (1 == type)
+        {
+            return read_object_at(field2, number, dict, &data, &is_stream);
+        }
+
+        // the objects in object streams have no stream
+        data.clear();
+
+        is_stream = false;
+
+        return read_object(number, dict);
+    }
+    // reads all the cross-reference sections at once; a file whose objects are all read, e.g.,
+    // for merging it into another document, is read much faster this way than by looking up
+    // each object through the sections. read_trailer() must be called first
+    bool load_xref()
+    {
+        int64_t offset = m_startxref;
+        std::string keyword;
+
+        m_entries.clear();
+
+        try
+        {
+            m_entries.resize((size_t)m_size);
+        }
+        catch (...)
+        {
+            return false;
+        }
+
+        for (int sections = 0; offset > 0 && sections < 10000; ++sections)
+        {
+            int64_t prev = 0;
+            bool result;
+
+            if (!read_at(offset, 4, keyword))
+            {
+                result = false;
+            }
+            else if ("xref" == keyword)
+            {
+                std::string trailer;
+
+                result = load_xref_table(offset, trailer);
+
+                get_int(trailer, "/Prev", prev);
+            }
+            else
+            {
+                result = read_xref_stream(offset, [this](int32_t number, int type, int64_t field2, int64_t field3)
+                    {
+                        set_entry(number, type, field2, field3);
+
+                        return true;
+                    }, prev);
+            }
+
+            if (!result)
+            {
+                m_entries.clear();
+
+                return false;
+            }
+            offset = prev;
+        }
+        return !m_entries.empty();
+    }
+    // calls fn(key, number) for each reference "n 0 R" in the dictionary, where 'key' is the last
+    // name before it, e.g., "/Kids" for all the kids. If 'result' isn't null, the dictionary is
+    // copied there with each object number replaced by the one 'fn' returns
+    template<typename function>
+    static void scan_refs(const std::string& dict, function fn, std::string* result)
+    {
+        std::string key;
+        size_t pos = 0;
+
+        while (pos < dict.size())
+        {
+            size_t start = pos;
+            char ch = dict[pos];
+
+            if ('/' == ch)
+            {
+                ++pos;
+
+                while (pos < dict.size() && !is_delimiter(dict[pos]))
+                {
+                    ++pos;
+                }
+
+                key.assign(dict, start, pos - start);
+            }
+            else if ('(' == ch)
+            {
+                int nesting = 0;
+
+                for (; pos < dict.size(); ++pos)
+                {
+                    if ('\\' == dict[pos])
+                    {
+                        ++pos;
+                    }
+                    else if ('(' == dict[pos])
+                    {
+                        ++nesting;
+                    }
+                    else if (')' == dict[pos] && 0 == --nesting)
+                    {
+                        break;
+                    }
+                }
+                pos = (std::min)(pos + 1, dict.size());
+            }
+            else if (isdigit((byte_t)ch) && (0 == pos || is_delimiter(dict[pos - 1])))
+            {
+                size_t end = skip_digits(dict, pos);
+                size_t next = skip_space(dict, end);
+                size_t generation_end = skip_digits(dict, next);
+                size_t r = skip_space(dict, generation_end);
+
+                pos = end;
+
+                if (next > end && generation_end > next && r > generation_end && r < dict.size() && 'R' == dict[r]
+                    && (r + 1 == dict.size() || is_delimiter(dict[r + 1])))
+                {
+                    int32_t number = (int32_t)atol(dict.c_str() + start);
+                    int32_t new_number = fn(key, number);
+
+                    if (result)
+                    {
+                        result->append(std::to_string(new_number));
+                        result->append(dict, end, r + 1 - end);
+                    }
+
+                    pos = r + 1;
+
+                    continue;
+                }
+            }
+            else
+            {
+                ++pos;
+            }
+
+            if (result)
+            {
+                result->append(dict, start, pos - start);
+            }
+        }
+    }
+    // the value of an integer entry of a dictionary
+    static bool get_int(const std::string& dict, const char* key, int64_t& value)
+    {
+        size_t pos = find_key(dict, key);
+
+        return pos != std::string::npos && read_int(dict, pos, value);
+    }
+    // the value of a name entry, without the slash
+    static bool get_name(const std::string& dict, const char* key, std::string& name)
+    {
+        size_t pos = find_key(dict, key);
+        size_t end;
+
+        if (pos == std::string::npos || dict[pos] != '/')
+        {
+            return false;
+        }
+
+        for (end = ++pos; end < dict.size() && !is_delimiter(dict[end]); ++end)
+        {
+        }
+
+        name.assign(dict, pos, end - pos);
+
+        return !name.empty();
+    }
+    // the values of an array of numbers, e.g., the /MediaBox
+    static bool get_real_array(const std::string& dict, const char* key, std::vector<double>& values)
+    {
+        size_t pos = find_key(dict, key);
+
+        values.clear();
+
+        if (pos == std::string::npos || dict[pos] != '[')
+        {
+            return false;
+        }
+
+        ++pos;
+
+        for (;;)
+        {
+            const char* start;
+            char* end;
+            double value;
+
+            pos = skip_space(dict, pos);
+
+            if (pos >= dict.size() || ']' == dict[pos])
+            {
+                break;
+            }
+
+            start = dict.c_str() + pos;
+            value = strtod(start, &end);
+
+            if (end == start)
+            {
+                return false;
+            }
+
+            values.push_back(value);
+
+            pos += (size_t)(end - start);
+        }
+        return pos < dict.size();
+    }
+    // a dictionary entry that holds a dictionary, e.g., the /Font of a resource dictionary
+    static bool get_dictionary(const std::string& dict, const char* key, std::string& value)
+    {
+        size_t pos = find_key(dict, key);
+
+        return pos != std::string::npos && extract_dictionary(dict, pos, value);
+    }
+    // an indirect reference: "n 0 R"
+    static bool get_ref(const std::string& dict, const char* key, int32_t& number)
+    {
+        size_t pos = find_key(dict, key);
+        int64_t value, generation;
+
+        if (pos != std::string::npos && read_int(dict, pos, value) && read_int(dict, pos, generation))
+        {
+            pos = skip_space(dict, pos);
+
+            if (pos < dict.size() && 'R' == dict[pos])
+            {
+                number = (int32_t)value;
+
+                return true;
+            }
+        }
+        return false;
+    }
+};
@@ -0,0 +1,445 @@
+/*
+//  Copyright (c) 2020 Peter Frane Jr. All Rights Reserved.
+//
+//  Use of this source code is governed by the BSD 3-Clause License that can be
+//  found in the LICENSE file.
+//
+//  This software is distributed on an "AS IS" basis, WITHOUT WARRANTY
+//  OF ANY KIND, either express or implied.
+//
+//  For inquiries, email the author at pfranejr AT hotmail.com
+*/
+
+#pragma once
+#include "types.h"
+#include "output_sink.hpp"
+
+// a name known at compile time, with its slash, e.g., pdf_name("/Type"). The length comes
+// from the array type of the literal, so the name is copied to the output without strlen
+class pdf_name
+{
+    const char* m_text;
+    size_t m_length;
+public:
+    template<size_t size>
+    constexpr pdf_name(const char (&text)[size]) : m_text(text), m_length(size - 1)
+    {
+    }
+    constexpr const char* text() const
+    {
+        return m_text;
+    }
+    constexpr size_t length() const
+    {
+        return m_length;
+    }
+};
+
+// formats the PDF syntax into a large block and hands it to the sink only when the block is full;
+// numbers are formatted by hand instead of going through printf
+class pdf_writer
+{
+    static const size_t buffer_size = 64 * 1024;
+
+    output_sink* m_sink{ nullptr };
+    std::vector<char> m_buffer;
+    size_t m_used{ 0 };
+private:
+    // makes room for 'size' bytes; returns where to write them
+    char* reserve(size_t size)
+    {
+        if (m_used + size > m_buffer.size())
+        {
+            flush();
+        }
+        return m_buffer.data() + m_used;
+    }
+    // writes the digits of 'value' backwards ending at 'end'; returns the position of the first digit
+    static char* format_digits(char* end, uint64_t value)
+    {
+        static const char digit_pairs[] =
+            "00010203040506070809"
+            "10111213141516171819"
+            "20212223242526272829"
+            "30313233343536373839"
+            "40414243444546474849"
+            "50515253545556575859"
+            "60616263646566676869"
+            "70717273747576777879"
+            "80818283848586878889"
+            "90919293949596979899";
+        char* p = end;
+
+        while (value >= 100)
+        {
+            const char* pair = digit_pairs + (value % 100) * 2;
+
+            value /= 100;
+            *--p = pair[1];
+            *--p = pair[0];
+        }
+        if (value >= 10)
+        {
+            const char* pair = digit_pairs + value * 2;
+
+            *--p = pair[1];
+            *--p = pair[0];
+        }
+        else
+        {
+            *--p = (char)('0' + value);
+        }
+        return p;
+    }
+public:
+    pdf_writer() : m_buffer(buffer_size)
+    {
+    }
+    pdf_writer(const pdf_writer&) = delete;
+    pdf_writer& operator=(const pdf_writer&) = delete;
+    ~pdf_writer()
+    {
+        flush();
+    }
+    void attach(output_sink& sink)
+    {
+        flush();
+
+        m_sink = &sink;
+    }
+    output_sink* sink() const
+    {
+        return m_sink;
+    }
+    // the offset of the next byte in the output
+    int64_t offset() const
+    {
+        return (m_sink ? m_sink->offset() : 0) + (int64_t)m_used;
+    }
+    bool failed() const
+    {
+        return m_sink && m_sink->failed();
+    }
+    // hands the buffered data to the sink
+    bool flush()
+    {
+        if (m_used > 0 && m_sink)
+        {
+            size_t size = m_used;
+
+            m_used = 0;
+
+            return m_sink->write(m_buffer.data(), size);
+        }
+        m_used = 0;
+
+        return true;
+    }
+    pdf_writer& write(const void* data, size_t size)
+    {
+        if (size > buffer_size / 2)
+        {
+            // large blocks, like the streams, go straight to the sink
+            flush();
+
+            if (m_sink)
+            {
+                m_sink->write(data, size);
+            }
+        }
+        else
+        {
+            std::memcpy(reserve(size), data, size);
+
+            m_used += size;
+        }
+        return *this;
+    }
+    pdf_writer& put(const char* str)
+    {
+        return write(str, strlen(str));
+    }
+    pdf_writer& put(const std::string& str)
+    {
+        return write(str.data(), str.size());
+    }
+    pdf_writer& put(char ch)
+    {
+        *reserve(1) = ch;
+
+        ++m_used;
+
+        return *this;
+    }
+    pdf_writer& put_int(int64_t value)
+    {
+        char tmp[24];
+        char* end = tmp + sizeof(tmp);
+        char* p;
+
+        if (value < 0)
+        {
+            p = format_digits(end, 0 - (uint64_t)value);
+
+            *--p = '-';
+        }
+        else
+        {
+            p = format_digits(end, (uint64_t)value);
+        }
+        return write(p, end - p);
+    }
+    // zero-padded number of exactly 'width' digits, e.g., the fields of the xref entries
+    pdf_writer& put_fixed_width(uint64_t value, int width)
+    {
+        char* dest = reserve(width);
+        char* p = dest + width;
+
+        while (p > dest)
+        {
+            *--p = (char)('0' + value % 10);
+
+            value /= 10;
+        }
+        m_used += width;
+
+        return *this;
+    }
+    // fixed-point number without the trailing zeros, e.g. 612 or 0.5
+    pdf_writer& put_real(double value, int decimals = 4)
+    {
+        static const uint64_t scale[] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+        uint64_t factor, whole, fraction;
+
+        if (decimals < 0)
+        {
+            decimals = 0;
+        }
+        else if (decimals > 6)
+        {
+            decimals = 6;
+        }
+        factor = scale[decimals];
+
+        if (value < 0)
+        {
+            value = -value;
+
+            // don't write -0
+            if ((uint64_t)(value * factor + 0.5) != 0)
+            {
+                put('-');
+            }
+        }
+
+        fraction = (uint64_t)(value * factor + 0.5);
+        whole = fraction / factor;
+        fraction %= factor;
+
+        put_int((int64_t)whole);
+
+        if (fraction != 0)
+        {
+            char tmp[8];
+            int length = decimals;
+
+            // remove the trailing zeros
+            while (0 == fraction % 10)
+            {
+                fraction /= 10;
+                --length;
+            }
+            for (int i = length - 1; i >= 0; --i)
+            {
+                tmp[i] = (char)('0' + fraction % 10);
+                fraction /= 10;
+            }
+            put('.');
+            write(tmp, length);
+        }
+        return *this;
+    }
+    pdf_writer& put(const pdf_name& name)
+    {
+        return write(name.text(), name.length());
+    }
+    // a name made at run time, e.g., the name of a font; the characters that can't be
+    // part of a name are written as #xx
+    pdf_writer& put_name(const std::string& name)
+    {
+        static const char hex_digits[] = "0123456789ABCDEF";
+
+        put('/');
+
+        for (char ch : name)
+        {
+            byte_t code = (byte_t)ch;
+
+            if (code < 0x21 || code > 0x7e || strchr("#/()<>[]{}%", ch))
+            {
+                put('#').put(hex_digits[code >> 4]).put(hex_digits[code & 0x0f]);
+            }
+            else
+            {
+                put(ch);
+            }
+        }
+        return *this;
+    }
+    // an indirect reference: "n 0 R"
+    pdf_writer& put_ref(int32_t number)
+    {
+        put_int(number);
+
+        return write(" 0 R", 4);
+    }
+    // one 20-byte entry of the cross-reference table
+    pdf_writer& put_xref_entry(uint64_t offset, uint32_t generation, char type)
+    {
+        char* dest = reserve(20);
+
+        m_used += 20;
+
+        for (int i = 9; i >= 0; --i)
+        {
+            dest[i] = (char)('0' + offset % 10);
+            offset /= 10;
+        }
+        dest[10] = ' ';
+        for (int i = 15; i >= 11; --i)
+        {
+            dest[i] = (char)('0' + generation % 10);
+            generation /= 10;
+        }
+        dest[16] = ' ';
+        dest[17] = type;
+        dest[18] = '\r';
+        dest[19] = '\n';
+
+        return *this;
+    }
+};
+
+// writes a dictionary with one entry per line, e.g., "<</Type /Font\n/BaseFont /Helvetica\n>>\n".
+// Each kind of value has its own function and the keys are pdf_names, so the entries are always
+// well-formed; the dictionary is closed by end(), or when it goes out of scope
+class pdf_dictionary
+{
+    pdf_writer& m_out;
+    bool m_open{ true };
+private:
+    pdf_writer& key(const pdf_name& key)
+    {
+        return m_out.put(key).put(' ');
+    }
+public:
+    explicit pdf_dictionary(pdf_writer& out) : m_out(out)
+    {
+        m_out.write("<<", 2);
+    }
+    pdf_dictionary(const pdf_dictionary&) = delete;
+    pdf_dictionary& operator=(const pdf_dictionary&) = delete;
+    ~pdf_dictionary()
+    {
+        end();
+    }
+    // a name value known at compile time, e.g., name("/Type", "/Font")
+    template<size_t size>
+    pdf_dictionary& name(const pdf_name& key, const char (&value)[size])
+    {
+        this->key(key).put(pdf_name(value)).put('\n');
+
+        return *this;
+    }
+    // a name value made at run time, without the slash
+    pdf_dictionary& name(const pdf_name& key, const std::string& value)
+    {
+        this->key(key).put_name(value).put('\n');
+
+        return *this;
+    }
+    pdf_dictionary& integer(const pdf_name& key, int64_t value)
+    {
+        this->key(key).put_int(value).put('\n');
+
+        return *this;
+    }
+    pdf_dictionary& real(const pdf_name& key, double value)
+    {
+        this->key(key).put_real(value).put('\n');
+
+        return *this;
+    }
+    // an indirect reference
+    pdf_dictionary& ref(const pdf_name& key, int32_t number)
+    {
+        this->key(key).put_ref(number).put('\n');
+
+        return *this;
+    }
+    // an array of integers; 'per_line' breaks a long array into lines
+    pdf_dictionary& integers(const pdf_name& key, const int32_t* values, size_t count, size_t per_line = 0)
+    {
+        this->key(key).put('[');
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (i > 0)
+            {
+                m_out.put((per_line != 0 && 0 == i % per_line) ? '\n' : ' ');
+            }
+            m_out.put_int(values[i]);
+        }
+        m_out.put("]\n");
+
+        return *this;
+    }
+    pdf_dictionary& reals(const pdf_name& key, const double* values, size_t count)
+    {
+        this->key(key).put('[');
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (i > 0)
+            {
+                m_out.put(' ');
+            }
+            m_out.put_real(values[i]);
+        }
+        m_out.put("]\n");
+
+        return *this;
+    }
+    // an array of indirect references, e.g., the /Kids of a page tree node
+    pdf_dictionary& refs(const pdf_name& key, const int_vector& numbers)
+    {
+        this->key(key).put('[');
+
+        for (size_t i = 0; i < numbers.size(); ++i)
+        {
+            if (i > 0)
+            {
+                m_out.put(' ');
+            }
+            m_out.put_ref(numbers[i]);
+        }
+        m_out.put("]\n");
+
+        return *this;
+    }
+    // the writer, for a value the functions above don't cover, e.g., a nested dictionary;
+    // the value must end with a new line
+    pdf_writer& value(const pdf_name& key)
+    {
+        return this->key(key);
+    }
+    void end()
+    {
+        if (m_open)
+        {
+            m_out.write(">>\n", 3);
+
+            m_open = false;
+        }
+    }
+};
@@ -36,7 +36,9 @@ enum class error_type
 {
     none,
     file_create_error,
+    file_write_error,
     file_open_failed,
+    invalid_file,
     out_of_memory,
     invalid_width,
     invalid_height,